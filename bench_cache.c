@@ -0,0 +1,107 @@
+/*
+ * bench_cache.c - lookup microbenchmark for the URI cache
+ *
+ * Fills a cache with small objects and times find_key on random keys from
+ * one or more threads, with the key formatting included in the timing as it
+ * is on the request path. Built with "make bench"; not part of the proxy.
+ *
+ *   ./bench_cache [entries [lookups [threads]]]
+ */
+#include "cache.h"
+#include "policy.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_OBJECT_SIZE 64
+#define BENCH_KEY_FORMAT "http://bench.example:8080/object/%zu"
+
+static cache_t *cache;
+static size_t entries = 10000;
+static size_t lookups = 200000;
+
+/* A thread's share of the lookups and what it found */
+typedef struct bench_job {
+    unsigned seed;
+    size_t lookups;
+    size_t hits;
+} bench_job_t;
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) +
+           (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *run_lookups(void *vargp) {
+    bench_job_t *job = vargp;
+    char key[MAXLINE];
+    for (size_t i = 0; i < job->lookups; i++) {
+        size_t n = (size_t)rand_r(&job->seed) % entries;
+        snprintf(key, sizeof(key), BENCH_KEY_FORMAT, n);
+        block_t *block = find_key(key, cache);
+        if (block != NULL) {
+            job->hits++;
+            release_block(block);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    size_t threads = 1;
+    if (argc > 1) {
+        entries = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        lookups = strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        threads = strtoul(argv[3], NULL, 10);
+    }
+    if (entries == 0 || threads == 0 ||
+        entries * BENCH_OBJECT_SIZE > MAX_CACHE_SIZE) {
+        fprintf(stderr, "usage: %s [entries [lookups [threads]]], with at "
+                        "most %d entries\n",
+                argv[0], MAX_CACHE_SIZE / BENCH_OBJECT_SIZE);
+        return 1;
+    }
+
+    cache = init_cache(DEFAULT_SHARDS, &policy_lru, false);
+    char data[BENCH_OBJECT_SIZE];
+    memset(data, 'x', sizeof(data));
+    block_meta_t meta = {.keepAlive = true, .lastModified = -1, .etag = ""};
+    char key[MAXLINE];
+    for (size_t i = 0; i < entries; i++) {
+        snprintf(key, sizeof(key), BENCH_KEY_FORMAT, i);
+        insert_block(cache, sizeof(data), key, data, &meta);
+    }
+
+    pthread_t tids[threads];
+    bench_job_t jobs[threads];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t t = 0; t < threads; t++) {
+        jobs[t] = (bench_job_t){.seed = 1 + t,
+                                .lookups = lookups / threads,
+                                .hits = 0};
+        pthread_create(&tids[t], NULL, run_lookups, &jobs[t]);
+    }
+    size_t hits = 0;
+    for (size_t t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        hits += jobs[t].hits;
+    }
+    double elapsed = seconds_since(&start);
+
+    size_t done = lookups / threads * threads;
+    printf("%zu entries, %zu lookups on %zu threads: %.3f us/lookup, "
+           "%.0f lookups/s, %zu hits\n",
+           entries, done, threads, elapsed * 1e6 / done, done / elapsed,
+           hits);
+    return 0;
+}
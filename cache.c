@@ -2,159 +2,863 @@
 
 /*standard lib's used*/
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
-// #include <cache.h>
+#include "cache.h"
+#include "compress.h"
+#include "disk.h"
+#include "metrics.h"
 
-// INIT variables for cache params:
-#define HOSTLEN 256
-#define SERVLEN 8
-#define MAX_OBJECT_SIZE (100 * 1024)
-#define MAX_CACHE_SIZE (1024 * 1024)
+// Buckets in a fresh shard; the table doubles when blocks outnumber buckets
+#define INIT_BUCKETS 64
 
-// IMPORTANT NOTE: LRU LOGIC: head of list is the most recent and the end of the
-// list is the least recent used
-typedef struct block_elem {
-    char *key;
-    char *data;
-    size_t refCount;
+// IMPORTANT NOTE: ORDER LOGIC: the shard's lists belong to the cache's policy
+// (policy.c), which queues blocks at the head of a list and evicts from the
+// tails. Blocks carry a stamp from the cache-wide clock, and every shard
+// publishes the stamp of the block it would evict next, so the next victim of
+// the whole cache is the one with the smallest stamp.
 
-    size_t blockSize;
-    struct block_elem *next;
-    struct block_elem *prev;
-
-} block_t;
+/*hash_key: 64-bit FNV-1a over the URI*/
+uint64_t hash_key(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
-typedef struct cache_blocks {
-    block_t *tail;
-    block_t *head;
-    size_t size;
-    size_t numBlock;
-} cache_t;
+static shard_t *shard_of(cache_t *cache, uint64_t hash) {
+    // high bits pick the shard, low bits pick the bucket inside it
+    return &cache->shards[(hash >> 32) & (cache->nshards - 1)];
+}
 
-cache_t *init_cache(void);
-block_t *find_key(const char *uri, cache_t *cache);
-void insert_block(cache_t *cache, size_t size, char *key, char *data);
-block_t *remove_block(cache_t *cache);
-void update_LRU(cache_t *cache, block_t *block);
+uint64_t cache_tick(cache_t *cache) {
+    return __atomic_add_fetch(&cache->clock, 1, __ATOMIC_RELAXED);
+}
 
 // initialize space for the main cache
-cache_t *init_cache(void) {
+cache_t *init_cache(size_t nshards, const policy_t *policy, bool admission) {
     cache_t *cache = malloc(sizeof(cache_t));
     // safety init cache's head and tail to NULL
     if (cache == NULL) {
         printf("Error init cache");
         exit(1);
     }
-    cache->head = NULL;
-    cache->tail = NULL;
+    // round the shard count up to a power of two
+    cache->nshards = 1;
+    while (cache->nshards < nshards) {
+        cache->nshards *= 2;
+    }
+    cache->shards = calloc(cache->nshards, sizeof(shard_t));
+    if (cache->shards == NULL) {
+        printf("Error init cache");
+        exit(1);
+    }
     cache->size = 0;
-    cache->numBlock = 0;
+    cache->capacity = MAX_CACHE_SIZE;
+    cache->clock = 0;
+    pthread_mutex_init(&cache->evictLock, NULL);
+    cache->policy = policy;
+    cache->sketch = admission ? tinylfu_init(TINYLFU_WIDTH) : NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->inserts = 0;
+    cache->evictions = 0;
+    cache->rejections = 0;
+    cache->expirations = 0;
+    cache->staleHits = 0;
+    cache->revalidations = 0;
+    cache->started = time(NULL);
+    cache->swept = cache->started;
+    slab_init(SLAB_ARENA_FACTOR * cache->capacity);
+
+    for (size_t s = 0; s < cache->nshards; s++) {
+        shard_t *shard = &cache->shards[s];
+        pthread_rwlock_init(&shard->lock, NULL);
+        pthread_mutex_init(&shard->flightLock, NULL);
+        shard->size = 0;
+        shard->numBlock = 0;
+        shard->nbuckets = INIT_BUCKETS;
+        shard->buckets = calloc(shard->nbuckets, sizeof(block_t *));
+        shard->oldest = UINT64_MAX;
+        shard->capacity = cache->capacity / cache->nshards;
+        shard->target = 0;
+        shard->heap = NULL;
+        shard->heapLen = 0;
+        shard->heapCap = 0;
+        shard->inflation = 0;
+        wheel_init(&shard->wheel, cache->started);
+        shard->flights = NULL;
+        if (shard->buckets == NULL) {
+            printf("Error init cache");
+            exit(1);
+        }
+    }
     return cache;
 }
 
-/*find_key: returns a block if key is present in cache if not returns NULL*/
-block_t *find_key(const char *uri, cache_t *cache) {
+/*grow_index: double the bucket array and rehash every block into it*/
+static void grow_index(shard_t *shard) {
+    size_t nbuckets = shard->nbuckets * 2;
+    block_t **buckets = calloc(nbuckets, sizeof(block_t *));
+    if (buckets == NULL) {
+        return; // keep the old table, chains just get longer
+    }
+    for (int l = 0; l < 2; l++) {
+        for (block_t *b = shard->lists[l].head; b != NULL; b = b->next) {
+            size_t i = b->hash & (nbuckets - 1);
+            b->hnext = buckets[i];
+            buckets[i] = b;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+/*unlink_index: take a block out of its hash bucket*/
+static void unlink_index(shard_t *shard, block_t *block) {
+    block_t **pp = &shard->buckets[block->hash & (shard->nbuckets - 1)];
+    while (*pp != NULL && *pp != block) {
+        pp = &(*pp)->hnext;
+    }
+    if (*pp != NULL) {
+        *pp = block->hnext;
+    }
+    block->hnext = NULL;
+}
 
-    block_t *currBlock;
+/*shard_find: bucket lookup, caller holds the shard lock*/
+static block_t *shard_find(shard_t *shard, const char *uri, uint64_t hash) {
+    block_t *currBlock = shard->buckets[hash & (shard->nbuckets - 1)];
 
-    for (currBlock = cache->head; currBlock != NULL;
-         currBlock = currBlock->next) {
-        if (strcmp(uri, currBlock->key) == 0) {
-            update_LRU(cache, currBlock);
+    for (; currBlock != NULL; currBlock = currBlock->hnext) {
+        if (currBlock->hash == hash && strcmp(uri, currBlock->key) == 0) {
             return currBlock;
         }
     }
+    return NULL;
+}
+
+void list_push(shard_t *shard, int i, block_t *block) {
+    block_list_t *list = &shard->lists[i];
+    block->list = i;
+    block->prev = NULL;
+    block->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = block;
+    } else {
+        list->tail = block;
+    }
+    list->head = block;
+    list->size += block->blockSize;
+    list->count++;
+}
+
+void list_unlink(shard_t *shard, block_t *block) {
+    block_list_t *list = &shard->lists[block->list];
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        list->head = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    } else {
+        list->tail = block->prev;
+    }
+    block->prev = NULL;
+    block->next = NULL;
+    list->size -= block->blockSize;
+    list->count--;
+}
+
+/*ghost_bucket: the chain a ghost hash lives on; the table must exist*/
+static ghost_entry_t **ghost_bucket(ghost_list_t *ghosts, uint64_t hash) {
+    return &ghosts->buckets[hash & (ghosts->nbuckets - 1)];
+}
+
+/*ghost_unlink: drop one ghost from both its chain and the FIFO*/
+static void ghost_unlink(ghost_list_t *ghosts, ghost_entry_t *g) {
+    ghost_entry_t **pp = ghost_bucket(ghosts, g->hash);
+    while (*pp != g) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = g->hnext;
+
+    if (g->prev != NULL) {
+        g->prev->next = g->next;
+    } else {
+        ghosts->head = g->next;
+    }
+    if (g->next != NULL) {
+        g->next->prev = g->prev;
+    } else {
+        ghosts->tail = g->prev;
+    }
+    ghosts->count--;
+    free(g);
+}
+
+/*ghost_grow: double the ghost table once ghosts outnumber its buckets*/
+static bool ghost_grow(ghost_list_t *ghosts) {
+    size_t nbuckets = ghosts->nbuckets ? ghosts->nbuckets * 2 : INIT_BUCKETS;
+    ghost_entry_t **buckets = calloc(nbuckets, sizeof(ghost_entry_t *));
+    if (buckets == NULL) {
+        return ghosts->buckets != NULL;
+    }
+    for (ghost_entry_t *g = ghosts->head; g != NULL; g = g->next) {
+        size_t i = g->hash & (nbuckets - 1);
+        g->hnext = buckets[i];
+        buckets[i] = g;
+    }
+    free(ghosts->buckets);
+    ghosts->buckets = buckets;
+    ghosts->nbuckets = nbuckets;
+    return true;
+}
+
+bool ghost_take(shard_t *shard, int i, uint64_t hash) {
+    ghost_list_t *ghosts = &shard->ghosts[i];
+    if (ghosts->count == 0) {
+        return false;
+    }
+    for (ghost_entry_t *g = *ghost_bucket(ghosts, hash); g != NULL;
+         g = g->hnext) {
+        if (g->hash == hash) {
+            ghost_unlink(ghosts, g);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ghost_add(shard_t *shard, int i, uint64_t hash, size_t max) {
+    ghost_list_t *ghosts = &shard->ghosts[i];
+    ghost_take(shard, i, hash); // keep one ghost per key
+    if (ghosts->count >= ghosts->nbuckets && !ghost_grow(ghosts)) {
+        return;
+    }
+    ghost_entry_t *g = malloc(sizeof(ghost_entry_t));
+    if (g == NULL) {
+        return; // a forgotten ghost only costs the policy some accuracy
+    }
+    g->hash = hash;
+    ghost_entry_t **bucket = ghost_bucket(ghosts, hash);
+    g->hnext = *bucket;
+    *bucket = g;
+    g->next = NULL;
+    g->prev = ghosts->tail;
+    if (ghosts->tail != NULL) {
+        ghosts->tail->next = g;
+    } else {
+        ghosts->head = g;
+    }
+    ghosts->tail = g;
+    ghosts->count++;
+
+    while (ghosts->count > max) {
+        ghost_unlink(ghosts, ghosts->head);
+    }
+}
+
+/*stale: true if the block's freshness lifetime has run out by now*/
+static bool stale(const block_t *block, time_t now) {
+    return block->expires != 0 && block->expires <= now;
+}
+
+/*reclaim_at: when a block that goes stale at expires stops being worth
+ * keeping: after its stale-while-revalidate window, or after
+ * CACHE_STALE_KEEP if it can be revalidated. 0 for never*/
+static time_t reclaim_at(const block_t *block, time_t expires) {
+    if (expires == 0) {
+        return 0;
+    }
+    time_t keep = block->staleWindow;
+    bool validator = block->etag[0] != '\0' || block->lastModified >= 0;
+    if (validator && keep < CACHE_STALE_KEEP) {
+        keep = CACHE_STALE_KEEP;
+    }
+    return expires + keep;
+}
+
+/*set_expiry: give a linked block a new staleness time and move its timer,
+ * caller holds the shard write lock*/
+static void set_expiry(shard_t *shard, block_t *block, time_t expires) {
+    block->expires = expires;
+    wheel_del(&shard->wheel, &block->timer);
+    block->timer.expires = reclaim_at(block, expires);
+    if (block->timer.expires != 0) {
+        wheel_add(&shard->wheel, &block->timer);
+    }
+}
+
+/*lock_for_hit: hits that only mark the block can share the shard*/
+static void lock_for_hit(cache_t *cache, shard_t *shard) {
+    if (cache->policy->readOnlyHit) {
+        pthread_rwlock_rdlock(&shard->lock);
+    } else {
+        pthread_rwlock_wrlock(&shard->lock);
+    }
+}
+
+/*lookup: probe the shard and pin what it finds, without counting*/
+static block_t *lookup(cache_t *cache, shard_t *shard, const char *uri,
+                       uint64_t hash) {
+    lock_for_hit(cache, shard);
+    block_t *block = shard_find(shard, uri, hash);
+    if (block != NULL && stale(block, time(NULL))) {
+        block = NULL; // left for the wheel, or for the fetch replacing it
+    }
+    if (block != NULL) {
+        // pin while the lock keeps eviction away; the cache's own reference
+        // guarantees the count is not zero here
+        __atomic_add_fetch(&block->refCount, 1, __ATOMIC_RELAXED);
+        cache->policy->hit(cache, shard, block);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return block;
+}
+
+/*count_lookup: one lookup of the key with this hash, hit or miss*/
+static void count_lookup(cache_t *cache, uint64_t hash, block_t *block) {
+    __atomic_add_fetch(block != NULL ? &cache->hits : &cache->misses, 1,
+                       __ATOMIC_RELAXED);
+    if (cache->sketch != NULL) {
+        tinylfu_record(cache->sketch, hash);
+    }
+}
+
+/*find_key: returns a pinned block if key is present in cache if not returns
+ * NULL*/
+block_t *find_key(const char *uri, cache_t *cache) {
+    uint64_t hash = hash_key(uri);
+    block_t *block = lookup(cache, shard_of(cache, hash), uri, hash);
+    count_lookup(cache, hash, block);
+    return block;
+}
+
+block_t *find_stale(const char *uri, cache_t *cache, bool *usable) {
+    uint64_t hash = hash_key(uri);
+    shard_t *shard = shard_of(cache, hash);
+    time_t now = time(NULL);
+    *usable = false;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    block_t *block = shard_find(shard, uri, hash);
+    if (block != NULL && stale(block, now)) {
+        __atomic_add_fetch(&block->refCount, 1, __ATOMIC_RELAXED);
+        *usable = now < block->expires + (time_t)block->staleWindow;
+    } else {
+        block = NULL; // fresh again since the miss, or gone
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (*usable) {
+        __atomic_add_fetch(&cache->staleHits, 1, __ATOMIC_RELAXED);
+    }
+    return block;
+}
+
+bool refresh_claim(block_t *block) {
+    return __atomic_exchange_n(&block->refreshing, 1, __ATOMIC_ACQUIRE) == 0;
+}
 
+void refresh_done(block_t *block) {
+    __atomic_store_n(&block->refreshing, 0, __ATOMIC_RELEASE);
+}
+
+/*shard_flight: in-flight lookup, caller holds the flight lock*/
+static flight_t *shard_flight(shard_t *shard, const char *uri, uint64_t hash) {
+    for (flight_t *f = shard->flights; f != NULL; f = f->next) {
+        if (f->hash == hash && strcmp(uri, f->key) == 0) {
+            return f;
+        }
+    }
     return NULL;
 }
 
-/*insert_block: insert new URI at the front and if there is not enough size to
- * insert(remove the last block)*/
-void insert_block(cache_t *cache, size_t size, char *key, char *data) {
-    if (find_key(key, cache) != NULL || size > MAX_OBJECT_SIZE)
+static void free_flight(flight_t *flight) {
+    pthread_cond_destroy(&flight->cv);
+    free(flight->key);
+    free(flight);
+}
+
+block_t *find_key_or_wait(const char *uri, cache_t *cache, bool *leader) {
+    uint64_t hash = hash_key(uri);
+    shard_t *shard = shard_of(cache, hash);
+    *leader = false;
+
+    block_t *block = lookup(cache, shard, uri, hash);
+    if (block != NULL) {
+        count_lookup(cache, hash, block);
+        return block;
+    }
+
+    pthread_mutex_lock(&shard->flightLock);
+    flight_t *flight = shard_flight(shard, uri, hash);
+    if (flight == NULL) {
+        // a fetch may have finished since the probe: its block is inserted
+        // before its flight ends, so looking again under the flight lock is
+        // enough to avoid a second fetch
+        block = lookup(cache, shard, uri, hash);
+        if (block == NULL) {
+            // first miss: register the fetch and let the caller do it
+            flight = malloc(sizeof(flight_t));
+            char *key = strdup(uri);
+            if (flight == NULL || key == NULL) {
+                printf("Error creating flight");
+                exit(1);
+            }
+            flight->key = key;
+            flight->hash = hash;
+            flight->waiters = 0;
+            flight->done = 0;
+            pthread_cond_init(&flight->cv, NULL);
+            flight->next = shard->flights;
+            shard->flights = flight;
+            *leader = true;
+        }
+        pthread_mutex_unlock(&shard->flightLock);
+        count_lookup(cache, hash, block);
+        return block;
+    }
+
+    // someone is already fetching it: wait, then look again
+    flight->waiters++;
+    while (!flight->done) {
+        pthread_cond_wait(&flight->cv, &shard->flightLock);
+    }
+    if (--flight->waiters == 0) {
+        free_flight(flight); // already unlinked by finish_flight
+    }
+    pthread_mutex_unlock(&shard->flightLock);
+
+    block = lookup(cache, shard, uri, hash);
+    count_lookup(cache, hash, block);
+    return block;
+}
+
+void finish_flight(const char *uri, cache_t *cache) {
+    uint64_t hash = hash_key(uri);
+    shard_t *shard = shard_of(cache, hash);
+
+    pthread_mutex_lock(&shard->flightLock);
+    flight_t *flight = shard_flight(shard, uri, hash);
+    if (flight != NULL) {
+        flight_t **pp = &shard->flights;
+        while (*pp != flight) {
+            pp = &(*pp)->next;
+        }
+        *pp = flight->next;
+        flight->done = 1;
+        if (flight->waiters == 0) {
+            free_flight(flight);
+        } else {
+            pthread_cond_broadcast(&flight->cv);
+        }
+    }
+    pthread_mutex_unlock(&shard->flightLock);
+}
+
+void release_block(block_t *block) {
+    if (block == NULL)
         return;
+    if (__atomic_sub_fetch(&block->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        slab_free(block); // key and data share its chunk
+    }
+}
+
+/*drop_block: take a block out of its shard for good, caller holds the shard
+ * write lock. The caller still owes the cache-wide size and the cache's
+ * reference*/
+static void drop_block(cache_t *cache, shard_t *shard, block_t *block) {
+    cache->policy->remove(cache, shard, block);
+    unlink_index(shard, block);
+    wheel_del(&shard->wheel, &block->timer);
+    shard->size = shard->size - block->blockSize;
+    shard->numBlock--;
+}
+
+/*forget_stale: finish dropping stale blocks chained through next*/
+static void forget_stale(cache_t *cache, block_t *stale) {
+    while (stale != NULL) {
+        block_t *block = stale;
+        stale = block->next;
+        __atomic_sub_fetch(&cache->size, block->blockSize, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cache->expirations, 1, __ATOMIC_RELAXED);
+        release_block(block);
+    }
+}
+
+/*expire_stale: run every shard's wheel up to now and drop the blocks that
+ * went stale. The wheels move in whole seconds, so only the first caller in
+ * a second does anything*/
+static void expire_stale(cache_t *cache) {
+    uint64_t now = time(NULL);
+    uint64_t swept = __atomic_load_n(&cache->swept, __ATOMIC_RELAXED);
+    if (now <= swept ||
+        !__atomic_compare_exchange_n(&cache->swept, &swept, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    for (size_t s = 0; s < cache->nshards; s++) {
+        shard_t *shard = &cache->shards[s];
+        block_t *stale = NULL;
+        pthread_rwlock_wrlock(&shard->lock);
+        wheel_timer_t *t = wheel_advance(&shard->wheel, now);
+        while (t != NULL) {
+            block_t *block =
+                (block_t *)((char *)t - offsetof(block_t, timer));
+            t = t->next;
+            drop_block(cache, shard, block);
+            block->next = stale;
+            stale = block;
+        }
+        pthread_rwlock_unlock(&shard->lock);
+        forget_stale(cache, stale);
+    }
+}
+
+/*oldest_shard: the shard whose next victim has the smallest stamp of those
+ * at least after, with that stamp in *stamp; NULL if no shard has one*/
+static shard_t *oldest_shard(cache_t *cache, uint64_t after, uint64_t *stamp) {
+    shard_t *victim = NULL;
+    uint64_t oldest = UINT64_MAX;
+    for (size_t s = 0; s < cache->nshards; s++) {
+        uint64_t next =
+            __atomic_load_n(&cache->shards[s].oldest, __ATOMIC_RELAXED);
+        if (next >= after && next < oldest) {
+            oldest = next;
+            victim = &cache->shards[s];
+        }
+    }
+    *stamp = oldest;
+    return victim;
+}
+
+/*admit: with the admission filter on, decide whether a block of size bytes
+ * for hash is worth what it would evict. Its estimated frequency must beat
+ * that of each victim in eviction order until enough bytes are free; only
+ * each shard's next victim can be seen, so a block that needs more than
+ * that is judged on those alone*/
+static bool admit(cache_t *cache, uint64_t hash, size_t size) {
+    size_t cached = __atomic_load_n(&cache->size, __ATOMIC_RELAXED);
+    if (cache->sketch == NULL || cached + size <= cache->capacity) {
+        return true;
+    }
+    size_t excess = cached + size - cache->capacity;
+    unsigned candidate = tinylfu_estimate(cache->sketch, hash);
+
+    uint64_t after = 0;
+    uint64_t stamp;
+    size_t freed = 0;
+    shard_t *shard;
+    while (freed < excess &&
+           (shard = oldest_shard(cache, after, &stamp)) != NULL) {
+        pthread_rwlock_rdlock(&shard->lock);
+        block_t *next = cache->policy->next(shard);
+        uint64_t victimHash = next != NULL ? next->hash : 0;
+        size_t victimSize = next != NULL ? next->blockSize : 0;
+        pthread_rwlock_unlock(&shard->lock);
+        if (next == NULL) {
+            break;
+        }
+
+        if (tinylfu_estimate(cache->sketch, victimHash) >= candidate) {
+            return false;
+        }
+        freed += victimSize;
+        after = stamp + 1;
+    }
+    return true;
+}
 
+/*spill_block: move an evicted block to the disk tier, which sends what it
+ * holds as is, so a gzipped body is inflated first*/
+static void spill_block(block_t *block) {
+    if (block->plainSize == 0) {
+        disk_store(block->key, block->data, block->blockSize,
+                   block->keepAlive, block->expires);
+        return;
+    }
+    char *plain = malloc(block->plainSize);
+    if (plain != NULL && compress_inflate(block->data, block->blockSize,
+                                          block->headLen, plain,
+                                          block->plainSize)) {
+        disk_store(block->key, plain, block->plainSize, block->keepAlive,
+                   block->expires);
+    }
+    free(plain);
+}
+
+/*store_block: insert new URI into its shard, queued by the policy, and if
+ * there is not enough size left in the cache evict blocks. The admission
+ * filter is consulted only if filter is set. True if the block was stored*/
+static bool store_block(cache_t *cache, size_t size, const char *key,
+                        const char *data, const block_meta_t *meta,
+                        bool filter) {
+    if (size > MAX_OBJECT_SIZE) {
+        return false;
+    }
+
+    uint64_t hash = hash_key(key);
+    if (filter && !admit(cache, hash, size)) {
+        __atomic_add_fetch(&cache->rejections, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    shard_t *shard = shard_of(cache, hash);
+
+    // header, key, etag and body share one chunk, filled before taking the
+    // lock
+    size_t keyLen = strlen(key) + 1;
+    size_t etagLen = strlen(meta->etag) + 1;
     block_t *new_block;
-    new_block = malloc(sizeof(block_t));
+    new_block = slab_alloc(sizeof(block_t) + keyLen + etagLen + size);
     if (new_block == NULL) {
         printf("Error creating block");
         exit(1);
     }
-    // create new block and insert it into cache
-    new_block->data = data;
-    new_block->key = key;
+    new_block->key = (char *)(new_block + 1);
+    new_block->etag = new_block->key + keyLen;
+    new_block->data = new_block->etag + etagLen;
+    memcpy(new_block->key, key, keyLen);
+    memcpy(new_block->etag, meta->etag, etagLen);
+    memcpy(new_block->data, data, size);
+    new_block->lastModified = meta->lastModified;
+    new_block->staleWindow = meta->staleWindow;
+    new_block->plainSize = meta->plainSize;
+    new_block->headLen = meta->headLen;
+
+    // a block that would be reclaimed as soon as it is stored is not stored
+    time_t now = time(NULL);
+    time_t reclaim = reclaim_at(new_block, meta->expires);
+    if (reclaim != 0 && reclaim <= now) {
+        slab_free(new_block);
+        return false;
+    }
+
+    pthread_rwlock_wrlock(&shard->lock);
+    block_t *old = shard_find(shard, key, hash);
+    if (old != NULL && !stale(old, now)) {
+        // another thread filled it first
+        pthread_rwlock_unlock(&shard->lock);
+        slab_free(new_block);
+        return false;
+    }
+    if (old != NULL) {
+        drop_block(cache, shard, old); // this fetch replaces it
+        old->next = NULL;
+    }
+
+    // create new block and hand it to the policy
     new_block->blockSize = size;
-    new_block->prev = NULL;
-    new_block->refCount = 1;
+    new_block->keepAlive = meta->keepAlive;
+    new_block->hash = hash;
+    new_block->freq = 0;
+    new_block->cost = meta->cost > 0 ? meta->cost : 1;
+    new_block->priority = 0;
+    new_block->heapIndex = 0;
+    new_block->lifetime = meta->expires > now ? meta->expires - now : 0;
+    new_block->refreshing = 0;
+    new_block->timer.slot = NULL;
+    new_block->refCount = 1; // the cache's reference
+
+    // grow before linking so the rehash does not see the new block
+    if (shard->numBlock + 1 > shard->nbuckets) {
+        grow_index(shard);
+    }
+    cache->policy->admit(cache, shard, new_block);
+
+    // update shard
+    shard->size = shard->size + size;
+    shard->numBlock++;
 
-    size_t freeSpace = MAX_CACHE_SIZE - cache->size;
+    // index the block by its key
+    size_t i = new_block->hash & (shard->nbuckets - 1);
+    new_block->hnext = shard->buckets[i];
+    shard->buckets[i] = new_block;
+    set_expiry(shard, new_block, meta->expires);
+    pthread_rwlock_unlock(&shard->lock);
+    __atomic_add_fetch(&cache->inserts, 1, __ATOMIC_RELAXED);
+    forget_stale(cache, old);
 
-    while (freeSpace < size) {
-        // remove block and reset tail to prev
-        // cache->size = cache->size - cache->tail->blockSize;
+    // evict with no shard lock held, so two inserters never wait on each
+    // other's shard. Evictors take turns: two of them seeing the same excess
+    // would otherwise both remove a block and evict more than needed. Stale
+    // blocks go first, so they never push out live ones
+    __atomic_add_fetch(&cache->size, size, __ATOMIC_RELAXED);
+    expire_stale(cache);
+    if (__atomic_load_n(&cache->size, __ATOMIC_RELAXED) <= cache->capacity)
+        return true;
+
+    // Victims are chained through their now unused next pointers and moved
+    // to the disk tier, if there is one, once the evictor's turn is over
+    block_t *evicted = NULL;
+    pthread_mutex_lock(&cache->evictLock);
+    while (__atomic_load_n(&cache->size, __ATOMIC_RELAXED) > cache->capacity) {
         block_t *rBlock = remove_block(cache);
-        if (rBlock->refCount == 0) {
-            free(rBlock->key);
-            free(rBlock->data);
-            free(rBlock);
+        if (rBlock == NULL) {
+            break;
         }
-        freeSpace = MAX_CACHE_SIZE - cache->size;
+        rBlock->next = evicted;
+        evicted = rBlock;
     }
+    pthread_mutex_unlock(&cache->evictLock);
 
-    if (cache->numBlock == 0) {
-        cache->tail = new_block;
-        new_block->next = NULL;
-    } else {
-        new_block->next = cache->head;
-        cache->head->prev = new_block;
+    while (evicted != NULL) {
+        block_t *rBlock = evicted;
+        evicted = rBlock->next;
+        if (disk_enabled() && !stale(rBlock, time(NULL))) {
+            spill_block(rBlock);
+        }
+        // readers still holding it keep it alive until they release
+        release_block(rBlock);
+    }
+    return true;
+}
+
+void insert_block(cache_t *cache, size_t size, const char *key,
+                  const char *data, const block_meta_t *meta) {
+    store_block(cache, size, key, data, meta, true);
+}
+
+void cache_refresh(cache_t *cache, block_t *block, const block_meta_t *meta) {
+    time_t now = time(NULL);
+    bool newTag = meta->etag[0] != '\0' && strcmp(meta->etag, block->etag);
+    bool newDate = meta->lastModified >= 0 &&
+                   meta->lastModified != block->lastModified;
+    if (newTag || newDate) {
+        // The validators sit in the block's chunk and are read with no lock
+        // held, so new ones come with a copy of the block that replaces it
+        block_meta_t fresh = *meta;
+        fresh.keepAlive = block->keepAlive;
+        fresh.cost = block->cost;
+        if (meta->expires == 0) {
+            fresh.expires = now + block->lifetime;
+        }
+        fresh.staleWindow = block->staleWindow;
+        fresh.lastModified = newDate ? meta->lastModified : block->lastModified;
+        fresh.etag = newTag ? meta->etag : block->etag;
+        fresh.plainSize = block->plainSize;
+        fresh.headLen = block->headLen;
+        // the block already earned its place, so the admission filter is
+        // not asked again
+        if (store_block(cache, block->blockSize, block->key, block->data,
+                        &fresh, false)) {
+            __atomic_add_fetch(&cache->revalidations, 1, __ATOMIC_RELAXED);
+        }
+        return;
     }
 
-    // update cache
-    cache->head = new_block;
-    cache->size = cache->size + size;
-    cache->numBlock++;
-    update_LRU(cache, new_block);
+    shard_t *shard = shard_of(cache, block->hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    // only a block still in the cache is worth refreshing
+    bool cached = shard_find(shard, block->key, block->hash) == block;
+    if (cached) {
+        if (meta->expires != 0) {
+            block->lifetime = meta->expires > now ? meta->expires - now : 0;
+        }
+        set_expiry(shard, block, now + block->lifetime);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (cached) {
+        __atomic_add_fetch(&cache->revalidations, 1, __ATOMIC_RELAXED);
+    }
 }
 
 block_t *remove_block(cache_t *cache) {
-    block_t *rBlock = cache->tail;
-    if (cache == NULL || cache->numBlock == 0)
+    if (cache == NULL)
         return NULL;
 
-    if (cache->numBlock == 1) {
-        cache->head = NULL;
-        cache->tail = NULL;
-    } else {
-        cache->tail = rBlock->prev;
-        cache->tail->next = NULL;
+    // pick the shard whose next victim was queued longest ago
+    uint64_t stamp;
+    shard_t *victim = oldest_shard(cache, 0, &stamp);
+    if (victim == NULL)
+        return NULL;
+
+    pthread_rwlock_wrlock(&victim->lock);
+    block_t *rBlock = cache->policy->victim(cache, victim);
+    if (rBlock == NULL) {
+        // emptied since we looked, and the policy has said so; retry
+        pthread_rwlock_unlock(&victim->lock);
+        return remove_block(cache);
     }
-    rBlock->next = NULL;
-    rBlock->prev = NULL;
-    cache->size = cache->size - rBlock->blockSize;
-    cache->numBlock--;
+
+    unlink_index(victim, rBlock);
+    wheel_del(&victim->wheel, &rBlock->timer);
+    victim->size = victim->size - rBlock->blockSize;
+    victim->numBlock--;
+    pthread_rwlock_unlock(&victim->lock);
+
+    __atomic_sub_fetch(&cache->size, rBlock->blockSize, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+    metrics_add(METRIC_EVICTIONS, 1);
     return rBlock;
 }
 
 void update_LRU(cache_t *cache, block_t *block) {
-    // change the pointers for the prev/nextblocks
-    if (cache == NULL || block == NULL || block == cache->head)
+    if (cache == NULL || block == NULL)
         return;
 
-    if (block == cache->tail) {
-        cache->tail = block->prev;
-        cache->tail->next = NULL;
-    } else {
-        block->prev->next = block->next;
-        block->next->prev = block->prev;
+    shard_t *shard = shard_of(cache, block->hash);
+    lock_for_hit(cache, shard);
+    // a block evicted in the meantime is no longer linked anywhere
+    if (block->prev != NULL || block == shard->lists[block->list].head) {
+        cache->policy->hit(cache, shard, block);
     }
+    pthread_rwlock_unlock(&shard->lock);
+}
 
-    // changing block pointers and cache head
-    block->prev = NULL;
-    block->next = cache->head;
-    cache->head->prev = block;
-    cache->head = block;
+block_t **cache_pin_all(cache_t *cache, size_t *n) {
+    size_t len = 0;
+    size_t cap = 64;
+    block_t **blocks = malloc(cap * sizeof(block_t *));
+    if (blocks == NULL) {
+        return NULL;
+    }
+    for (size_t s = 0; s < cache->nshards; s++) {
+        shard_t *shard = &cache->shards[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        for (int l = 0; l < 2; l++) {
+            for (block_t *b = shard->lists[l].head; b != NULL; b = b->next) {
+                if (len == cap) {
+                    block_t **grown =
+                        realloc(blocks, 2 * cap * sizeof(block_t *));
+                    if (grown == NULL) {
+                        continue; // keep what fit
+                    }
+                    blocks = grown;
+                    cap *= 2;
+                }
+                __atomic_add_fetch(&b->refCount, 1, __ATOMIC_RELAXED);
+                blocks[len++] = b;
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    *n = len;
+    return blocks;
+}
+
+void cache_stats(cache_t *cache, cache_stats_t *stats) {
+    stats->policy = cache->policy->name;
+    stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    stats->inserts = __atomic_load_n(&cache->inserts, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+    stats->rejections = __atomic_load_n(&cache->rejections, __ATOMIC_RELAXED);
+    stats->expirations =
+        __atomic_load_n(&cache->expirations, __ATOMIC_RELAXED);
+    stats->staleHits = __atomic_load_n(&cache->staleHits, __ATOMIC_RELAXED);
+    stats->revalidations =
+        __atomic_load_n(&cache->revalidations, __ATOMIC_RELAXED);
+    stats->size = __atomic_load_n(&cache->size, __ATOMIC_RELAXED);
+    stats->seconds = difftime(time(NULL), cache->started);
 }
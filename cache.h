@@ -1,41 +1,275 @@
+#ifndef CACHE_H
+#define CACHE_H
+
 #include "csapp.h"
+#include "policy.h"
+#include "slab.h"
+#include "tinylfu.h"
+#include "wheel.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+#define MAX_OBJECT_SIZE (100 * 1024)
+#define MAX_CACHE_SIZE (1024 * 1024)
+#define DEFAULT_SHARDS 16
+/* Slab arena size as a multiple of the cache capacity, leaving room for
+   size-class rounding and partly filled pages */
+#define SLAB_ARENA_FACTOR 4
+/* Seconds a stale block with a validator is kept for revalidation */
+#define CACHE_STALE_KEEP 600
+
+/*Cache Implementation: the cache is split into shards picked by the hash of
+the URI. Each shard keeps its blocks in up to two doubly linked lists that the
+replacement policy (policy.h) orders, plus a hash table indexing the same
+blocks by key. Each shard has its own lock, so requests for different URIs
+rarely contend; hits on policies that only mark a block take it shared.
+
+Expiry: a block whose response gave it a freshness lifetime has a timer on
+its shard's timing wheel (wheel.h). Lookups treat a stale block as a miss,
+and the wheels are run once a second, from insert_block, to drop the blocks
+that went stale before anything live is evicted to make room. A stale block
+is kept a while longer if it can still be used: for its stale-while-
+revalidate window, or for CACHE_STALE_KEEP if it has a validator the origin
+can answer a conditional request against. find_stale hands it out, and
+cache_refresh makes it fresh again in place when the origin says it has not
+changed.
+
+Compression: with compress.h on, a block may hold its response with the body
+gzipped, plainSize then giving its size as sent. blockSize, and so every size
+the cache and its policies account, is what the block actually holds.
 
-/*Cache Implementation: doubly linked list with each block containing data on
-URI and URI data With LRU structure of most recent: head of cache & least
-recent: tail of cache*/
+Block lifetime: refCount counts the cache itself while the block is linked,
+plus every reader that pinned it with find_key. Readers use the data with no
+lock held and drop their pin with release_block; whoever drops the last
+reference frees the block, so an evicted block lives until its last reader
+is done with it.*/
 typedef struct block_elem {
-    char *key;
-    char *data;
-    size_t refCount;
+    char *key;  // stored right after the block, in the same slab chunk
+    char *data; // after the key and the etag
+    size_t refCount; // updated with atomics, see above
 
     size_t blockSize;
+    bool keepAlive;   // the cached response head lets the client persist
+    uint64_t hash;    // hash of key, computed once on insert
+    uint64_t lastUse; // eviction order: the cache clock when the policy last
+                      // queued it, or the bits of its GDSF priority
+    uint8_t list;     // which of the shard's lists the block is on
+    uint8_t freq;     // policy hit marks, updated with atomics
+    uint32_t cost;    // microseconds the origin took to deliver it
+    double priority;  // GDSF value: inflation + freq * cost / size
+    size_t heapIndex; // position in the shard's GDSF heap
+    time_t expires;   // when it goes stale, 0 for never
+    uint32_t lifetime;    // seconds it stays fresh after a fetch
+    uint32_t staleWindow; // seconds it may be served stale while revalidated
+    time_t lastModified;  // validator, -1 if none
+    char *etag;           // validator, after the key; "" if none
+    uint32_t plainSize;   // bytes as sent if the body is stored gzipped,
+                          // else 0
+    uint32_t headLen;     // bytes of head before a gzipped body
+    uint8_t refreshing;   // a revalidation has been claimed, atomic
+    wheel_timer_t timer;  // fires when the block is no longer worth keeping
     struct block_elem *next;
     struct block_elem *prev;
+    struct block_elem *hnext; // next block in the same hash bucket
 
 } block_t;
 
-typedef struct cache_blocks {
-    block_t *tail;
+/*What the cache keeps about a response besides its bytes*/
+typedef struct block_meta {
+    bool keepAlive;       // the response head lets the client persist
+    uint32_t cost;        // microseconds the origin took to deliver it
+    time_t expires;       // when it goes stale, 0 for never
+    uint32_t staleWindow; // seconds it may be served stale while revalidated
+    time_t lastModified;  // validator, -1 if none
+    const char *etag;     // validator, "" if none
+    uint32_t plainSize;   // bytes as sent if the body is gzipped, else 0
+    uint32_t headLen;     // bytes of head before a gzipped body
+} block_meta_t;
+
+/*An in-flight miss: the first thread to miss on a URI fetches it, later
+threads missing on the same URI wait on cv for it instead of going to the
+origin themselves*/
+typedef struct flight_elem {
+    char *key;
+    uint64_t hash;
+    size_t waiters;     // threads sleeping on cv
+    int done;           // set by finish_flight
+    pthread_cond_t cv;  // waited on with the shard flightLock
+    struct flight_elem *next;
+} flight_t;
+
+/*A policy queue: most recently queued block at head*/
+typedef struct block_list {
     block_t *head;
+    block_t *tail;
+    size_t size; // bytes
+    size_t count;
+} block_list_t;
+
+/*Hashes of recently evicted keys, oldest first, for policies that learn
+from blocks they evicted too early*/
+typedef struct ghost_elem {
+    uint64_t hash;
+    struct ghost_elem *next; // FIFO order, towards the newest
+    struct ghost_elem *prev;
+    struct ghost_elem *hnext; // next ghost in the same bucket
+} ghost_entry_t;
+
+typedef struct ghost_list {
+    ghost_entry_t *head; // oldest
+    ghost_entry_t *tail;
+    ghost_entry_t **buckets;
+    size_t nbuckets;
+    size_t count;
+} ghost_list_t;
+
+typedef struct cache_shard {
+    pthread_rwlock_t lock; // guards everything below but flights
     size_t size;
     size_t numBlock;
+    block_t **buckets; // hash index, nbuckets is a power of two
+    size_t nbuckets;
+    uint64_t oldest; // stamp of the next victim, read without the lock
+    size_t capacity; // this shard's share of the cache, sizes segments
+    size_t target;   // adaptive size of lists[0], for ARC
+    block_list_t lists[2]; // policy queues
+    ghost_list_t ghosts[2];
+    block_t **heap;   // GDSF min-heap on priority
+    size_t heapLen;
+    size_t heapCap;
+    double inflation; // GDSF clock: priority of the last block evicted
+    wheel_t wheel;    // timers of the blocks that can go stale
+
+    pthread_mutex_t flightLock; // guards flights, taken before lock
+    flight_t *flights;          // misses currently being fetched
+} shard_t;
+
+typedef struct cache_blocks {
+    shard_t *shards;
+    size_t nshards;  // power of two
+    size_t size;     // bytes cached across all shards, updated atomically
+    size_t capacity; // MAX_CACHE_SIZE
+    uint64_t clock;  // logical time stamped on blocks for LRU order
+    uint64_t swept;  // the second the wheels were last run to
+    pthread_mutex_t evictLock; // one evictor at a time, taken before shards
+    const policy_t *policy;
+    tinylfu_t *sketch; // admission filter, NULL to admit every block
+
+    // counters, updated atomically
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long inserts;
+    unsigned long evictions;
+    unsigned long rejections;    // blocks the admission filter turned away
+    unsigned long expirations;   // blocks dropped for going stale
+    unsigned long staleHits;     // stale blocks served while revalidated
+    unsigned long revalidations; // stale blocks the origin said were current
+    time_t started;
 } cache_t;
 
-/*init_cache: initialize an empty cache with a size of 0*/
-cache_t *init_cache(void);
+/*Snapshot of the cache counters*/
+typedef struct cache_stats {
+    const char *policy;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long inserts;
+    unsigned long evictions;
+    unsigned long rejections;
+    unsigned long expirations;
+    unsigned long staleHits;
+    unsigned long revalidations;
+    size_t size;
+    double seconds; // since init_cache, for lookup throughput
+} cache_stats_t;
+
+/*hash_key: hash of a URI as stored in block_t*/
+uint64_t hash_key(const char *key);
+
+/*init_cache: initialize an empty cache of nshards shards with a size of 0,
+ * replacing blocks by policy. With admission set, a new block that would
+ * evict others is only stored if its URI is looked up more often than
+ * theirs*/
+cache_t *init_cache(size_t nshards, const policy_t *policy, bool admission);
 
-/*find_key: searches through cache to see if URI data is still in cache*/
+/*find_key: searches the URI's shard to see if fresh URI data is still in
+ * cache and returns the block pinned; the caller must hand it back to
+ * release_block*/
 block_t *find_key(const char *uri, cache_t *cache);
 
-/*insert_block: inserts a newly malloced block to the head of the cache*/
-void insert_block(cache_t *cache, size_t size, char *key, char *data);
+/*find_key_or_wait: like find_key, but coalesces concurrent misses. On a miss
+ * with nobody fetching the URI, returns NULL with *leader set: the caller must
+ * fetch it and call finish_flight. On a miss with a fetch in flight, waits
+ * for it and returns the block it cached, or NULL with *leader clear if it
+ * could not be cached*/
+block_t *find_key_or_wait(const char *uri, cache_t *cache, bool *leader);
+
+/*finish_flight: leader is done with uri (cached or not); wake its waiters*/
+void finish_flight(const char *uri, cache_t *cache);
+
+/*release_block: drop one reference to a block, freeing it on the last one*/
+void release_block(block_t *block);
+
+/*find_stale: after a miss, the stale block still kept for uri, pinned like
+ * find_key's, or NULL. *usable is set if it is inside its stale-while-
+ * revalidate window and may be served while it is revalidated*/
+block_t *find_stale(const char *uri, cache_t *cache, bool *usable);
+
+/*refresh_claim: true for the one caller that gets to revalidate a stale
+ * block until it calls refresh_done*/
+bool refresh_claim(block_t *block);
+
+/*refresh_done: let the block be claimed for revalidation again*/
+void refresh_done(block_t *block);
+
+/*cache_refresh: the origin says a stale block is still current; make it
+ * fresh again in place with the freshness of meta, or with its old lifetime
+ * if meta gives none. If meta brings a new ETag or Last-Modified, a copy of
+ * the block carrying them replaces it instead, past the admission filter.
+ * Counted as a revalidation only if the block is refreshed or replaced*/
+void cache_refresh(cache_t *cache, block_t *block, const block_meta_t *meta);
 
-/*remove_block: removes the block from the tail of the cache(least recently used
- * block)*/
+/*insert_block: copies key and data into a new block at the head of its shard
+ * and evicts least recently used blocks until the cache fits again, unless
+ * the admission filter judges the block worth less than those victims. meta
+ * says how long it stays fresh and how it can be revalidated. A stale block
+ * already cached under key is replaced*/
+void insert_block(cache_t *cache, size_t size, const char *key,
+                  const char *data, const block_meta_t *meta);
+
+/*remove_block: removes the least recently used block of the whole cache, the
+ * oldest of the shard tails. The cache's reference passes to the caller*/
 block_t *remove_block(cache_t *cache);
 
 /*update_LRU: If looking through cache for URI and finds one then moves that
- * block to the head(most recently used block)*/
+ * block to the head of its shard(most recently used block), or whatever a hit
+ * means to the cache's policy*/
 void update_LRU(cache_t *cache, block_t *block);
+
+/*cache_pin_all: pin every cached block into a malloced array of *n blocks,
+ * to walk the cache with no lock held. The caller releases each block and
+ * frees the array; NULL if memory ran out*/
+block_t **cache_pin_all(cache_t *cache, size_t *n);
+
+/*cache_stats: copy the current counters out*/
+void cache_stats(cache_t *cache, cache_stats_t *stats);
+
+/*list_push: queue a block at the head of list i of its shard*/
+void list_push(shard_t *shard, int i, block_t *block);
+
+/*list_unlink: take a block off whichever list it is on*/
+void list_unlink(shard_t *shard, block_t *block);
+
+/*ghost_add: remember an evicted hash in ghost list i, keeping at most max*/
+void ghost_add(shard_t *shard, int i, uint64_t hash, size_t max);
+
+/*ghost_take: forget hash from ghost list i; true if it was there*/
+bool ghost_take(shard_t *shard, int i, uint64_t hash);
+
+/*cache_tick: advance the cache clock and return the new stamp*/
+uint64_t cache_tick(cache_t *cache);
+
+#endif /* CACHE_H */
@@ -0,0 +1,264 @@
+/*
+ * compress.c - gzip bodies of cached responses with zlib
+ *
+ * Each worker keeps one deflate and one inflate stream and resets them
+ * between responses rather than setting zlib up per call, along with the
+ * buffers responses are packed into and inflated back out to.
+ */
+#define _GNU_SOURCE
+#include "compress.h"
+#include "cache.h"
+#include "csapp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+/* zlib window bits for a gzip wrapper around the deflate stream */
+#define GZIP_WINDOW (15 + 16)
+
+static bool enabled;
+
+static unsigned long stored;
+static unsigned long direct;
+static unsigned long inflated;
+static size_t plainBytes;
+static size_t packedBytes;
+
+static __thread z_stream deflater;
+static __thread bool deflaterReady;
+static __thread z_stream inflater;
+static __thread bool inflaterReady;
+static __thread char *packBuffer;  // compress_response output
+static __thread char *plainBuffer; // compress_send inflates into it
+
+/* head_length - bytes of the head at data, blank line included, or 0 if it
+   does not end within COMPRESS_MAX_HEAD bytes */
+static size_t head_length(const char *data, size_t size) {
+    size_t limit = size < COMPRESS_MAX_HEAD ? size : COMPRESS_MAX_HEAD;
+    const char *end = memmem(data, limit, "\r\n\r\n", 4);
+    return end != NULL ? (size_t)(end - data) + 4 : 0;
+}
+
+/* next_line - copy the head line at *p into line, NUL-terminated without its
+   CRLF, and step past it; false at the blank line ending the head */
+static bool next_line(const char **p, const char *end, char *line) {
+    const char *lf = memchr(*p, '\n', end - *p);
+    if (lf == NULL) {
+        return false;
+    }
+    size_t len = lf - *p;
+    if (len > 0 && (*p)[len - 1] == '\r') {
+        len--;
+    }
+    len = len < MAXLINE - 1 ? len : MAXLINE - 1;
+    memcpy(line, *p, len);
+    line[len] = '\0';
+    *p = lf + 1;
+    return len > 0;
+}
+
+/* field_value - the value of a header line called name, or NULL */
+static const char *field_value(const char *line, const char *name) {
+    size_t n = strlen(name);
+    if (strncasecmp(line, name, n) != 0 || line[n] != ':') {
+        return NULL;
+    }
+    return line + n + 1 + strspn(line + n + 1, " \t");
+}
+
+/* compressible_type - true for a Content-Type whose bodies are text */
+static bool compressible_type(const char *type) {
+    static const char *const prefixes[] = {
+        "text/",           "application/json",      "application/javascript",
+        "application/xml", "application/xhtml+xml", "image/svg+xml"};
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        if (strncasecmp(type, prefixes[i], strlen(prefixes[i])) == 0) {
+            return true;
+        }
+    }
+    size_t len = strcspn(type, ";");
+    for (size_t i = 0; i + 4 <= len; i++) {
+        if (strncasecmp(type + i, "+xml", 4) == 0 ||
+            (i + 5 <= len && strncasecmp(type + i, "+json", 5) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* eligible - true if the head of a body of bodyLen bytes allows storing the
+   body gzipped */
+static bool eligible(const char *data, size_t headLen, size_t bodyLen) {
+    const char *p = data;
+    const char *end = data + headLen;
+    char line[MAXLINE];
+    int status;
+    if (!next_line(&p, end, line) ||
+        sscanf(line, "HTTP/%*d.%*d %d", &status) != 1 || status != 200) {
+        return false;
+    }
+
+    bool framed = false;
+    bool text = false;
+    const char *value;
+    while (next_line(&p, end, line)) {
+        if ((value = field_value(line, "Content-Length")) != NULL) {
+            char *stop;
+            long long length = strtoll(value, &stop, 10);
+            framed = stop != value && length == (long long)bodyLen;
+        } else if ((value = field_value(line, "Content-Type")) != NULL) {
+            text = compressible_type(value);
+        } else if ((value = field_value(line, "Content-Encoding")) != NULL) {
+            if (strcasecmp(value, "identity") != 0) {
+                return false;
+            }
+        } else if (field_value(line, "Transfer-Encoding") != NULL) {
+            return false;
+        } else if ((value = field_value(line, "Cache-Control")) != NULL) {
+            if (strcasestr(value, "no-transform") != NULL) {
+                return false;
+            }
+        }
+    }
+    return framed && text;
+}
+
+/* gzip_head - the head of a response stored gzipped as sent to a client
+   that accepts gzip, into out; returns its length */
+static size_t gzip_head(const char *data, uint32_t headLen, size_t bodyLen,
+                        char *out, size_t n) {
+    const char *p = data;
+    const char *end = data + headLen;
+    char line[MAXLINE];
+    size_t len = 0;
+    bool first = true;
+    const char *value;
+    while (next_line(&p, end, line) && len < n) {
+        if (first) {
+            len += snprintf(out + len, n - len, "%s\r\n", line);
+            first = false;
+        } else if (field_value(line, "Content-Length") != NULL) {
+            len += snprintf(out + len, n - len, "Content-Length: %zu\r\n",
+                            bodyLen);
+        } else if ((value = field_value(line, "ETag")) != NULL &&
+                   strncmp(value, "W/", 2) != 0) {
+            // the gzipped bytes are not the representation the tag names
+            len += snprintf(out + len, n - len, "ETag: W/%s\r\n", value);
+        } else {
+            len += snprintf(out + len, n - len, "%s\r\n", line);
+        }
+    }
+    if (len < n) {
+        len += snprintf(out + len, n - len,
+                        "Content-Encoding: gzip\r\n"
+                        "Vary: Accept-Encoding\r\n\r\n");
+    }
+    return len < n ? len : n - 1;
+}
+
+void compress_init(void) {
+    enabled = true;
+}
+
+bool compress_enabled(void) {
+    return enabled;
+}
+
+size_t compress_response(const char *data, size_t size, const char **out,
+                         uint32_t *headLen) {
+    size_t head = head_length(data, size);
+    if (!enabled || head == 0 || size - head < COMPRESS_MIN_BODY ||
+        !eligible(data, head, size - head)) {
+        return 0;
+    }
+    if (packBuffer == NULL && (packBuffer = malloc(MAX_OBJECT_SIZE)) == NULL) {
+        return 0;
+    }
+    if (!deflaterReady) {
+        memset(&deflater, 0, sizeof(deflater));
+        if (deflateInit2(&deflater, Z_BEST_SPEED, Z_DEFLATED, GZIP_WINDOW, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 0;
+        }
+        deflaterReady = true;
+    } else {
+        deflateReset(&deflater);
+    }
+
+    // Output is capped at seven eighths of the body: a deflate that does
+    // not fit there is not worth the inflating it would cost later
+    size_t body = size - head;
+    size_t room = body - body / 8;
+    memcpy(packBuffer, data, head);
+    deflater.next_in = (Bytef *)(data + head);
+    deflater.avail_in = body;
+    deflater.next_out = (Bytef *)(packBuffer + head);
+    deflater.avail_out = room;
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    size_t packed = head + (room - deflater.avail_out);
+
+    __atomic_add_fetch(&stored, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&plainBytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&packedBytes, packed, __ATOMIC_RELAXED);
+    *out = packBuffer;
+    *headLen = head;
+    return packed;
+}
+
+bool compress_inflate(const char *data, size_t size, uint32_t headLen,
+                      char *out, uint32_t plainSize) {
+    if (!inflaterReady) {
+        memset(&inflater, 0, sizeof(inflater));
+        if (inflateInit2(&inflater, GZIP_WINDOW) != Z_OK) {
+            return false;
+        }
+        inflaterReady = true;
+    } else {
+        inflateReset(&inflater);
+    }
+    memcpy(out, data, headLen);
+    inflater.next_in = (Bytef *)(data + headLen);
+    inflater.avail_in = size - headLen;
+    inflater.next_out = (Bytef *)(out + headLen);
+    inflater.avail_out = plainSize - headLen;
+    return inflate(&inflater, Z_FINISH) == Z_STREAM_END &&
+           inflater.avail_out == 0;
+}
+
+bool compress_send(int fd, const char *data, size_t size, uint32_t headLen,
+                   uint32_t plainSize, bool gzipOk) {
+    if (plainSize == 0) {
+        return rio_writen(fd, (void *)data, size) >= 0;
+    }
+    if (gzipOk) {
+        char head[COMPRESS_MAX_HEAD + 128];
+        size_t len =
+            gzip_head(data, headLen, size - headLen, head, sizeof(head));
+        __atomic_add_fetch(&direct, 1, __ATOMIC_RELAXED);
+        return rio_writen(fd, head, len) >= 0 &&
+               rio_writen(fd, (void *)(data + headLen), size - headLen) >= 0;
+    }
+
+    if (plainBuffer == NULL &&
+        (plainBuffer = malloc(MAX_OBJECT_SIZE)) == NULL) {
+        return false;
+    }
+    if (!compress_inflate(data, size, headLen, plainBuffer, plainSize)) {
+        return false;
+    }
+    __atomic_add_fetch(&inflated, 1, __ATOMIC_RELAXED);
+    return rio_writen(fd, plainBuffer, plainSize) >= 0;
+}
+
+void compress_stats(compress_stats_t *stats) {
+    stats->stored = __atomic_load_n(&stored, __ATOMIC_RELAXED);
+    stats->direct = __atomic_load_n(&direct, __ATOMIC_RELAXED);
+    stats->inflated = __atomic_load_n(&inflated, __ATOMIC_RELAXED);
+    stats->plainBytes = __atomic_load_n(&plainBytes, __ATOMIC_RELAXED);
+    stats->packedBytes = __atomic_load_n(&packedBytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,65 @@
+/*
+ * compress.h - gzip storage for compressible responses in the memory cache
+ *
+ * With compression on, a text-like response is stored with its head as the
+ * origin sent it and its body gzipped at the fastest level, and the cache
+ * charges it for the bytes it actually holds. A response is only stored that
+ * way if it is a plain 200 whose Content-Length frames the whole body, whose
+ * Content-Type is text, JSON, JavaScript or XML, which no Content-Encoding or
+ * no-transform already rules out, and whose body shrinks by at least an
+ * eighth.
+ *
+ * A client whose Accept-Encoding takes gzip is sent the stored bytes as they
+ * are, behind a head rewritten to say Content-Encoding: gzip, with the
+ * compressed Content-Length and a weak ETag. Any other client is sent the
+ * original head and the body inflated again.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bodies smaller than this are stored as sent */
+#define COMPRESS_MIN_BODY 256
+/* Heads longer than this are stored as sent */
+#define COMPRESS_MAX_HEAD (8 * 1024)
+
+/* Snapshot of the compression counters */
+typedef struct compress_stats {
+    unsigned long stored;   // responses stored gzipped
+    unsigned long direct;   // hits sent gzipped
+    unsigned long inflated; // hits inflated for a client without gzip
+    size_t plainBytes;      // of the responses stored gzipped, as sent
+    size_t packedBytes;     // of the same responses, as stored
+} compress_stats_t;
+
+/*compress_init: store compressible responses gzipped from now on*/
+void compress_init(void);
+
+/*compress_enabled: true once compress_init has been called*/
+bool compress_enabled(void);
+
+/*compress_response: the response in [data, data + size) with its body
+  gzipped, in a buffer of the calling thread's that stays valid until its
+  next call. Returns the size to store and sets *headLen, or 0 if the
+  response is not worth storing compressed*/
+size_t compress_response(const char *data, size_t size, const char **out,
+                         uint32_t *headLen);
+
+/*compress_send: write a cached response to fd. One whose body is stored
+  gzipped, plainSize not 0, is sent as stored if gzipOk and inflated back
+  otherwise. False if the write fails*/
+bool compress_send(int fd, const char *data, size_t size, uint32_t headLen,
+                   uint32_t plainSize, bool gzipOk);
+
+/*compress_inflate: the plainSize bytes of a response stored gzipped, as the
+  origin sent it, into out; false if the stored body is corrupt*/
+bool compress_inflate(const char *data, size_t size, uint32_t headLen,
+                      char *out, uint32_t plainSize);
+
+/*compress_stats: copy the current counters out*/
+void compress_stats(compress_stats_t *stats);
+
+#endif /* COMPRESS_H */
@@ -0,0 +1,308 @@
+/*
+ * disk.c - file-per-response second tier with an in-memory LRU index
+ */
+#include "disk.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DISK_SUFFIX ".obj"
+
+typedef struct disk_entry {
+    char *key;
+    unsigned long long id; // file name
+    size_t size;
+    bool keepAlive;
+    time_t expires; // 0 for never
+    struct disk_entry *hnext; // bucket chain
+    struct disk_entry *next;  // LRU order, most recently used at head
+    struct disk_entry *prev;
+} disk_entry_t;
+
+static char dir[PATH_MAX - 32]; // leaves room for the file names
+static bool enabled;
+static unsigned long long nextId;
+
+static disk_entry_t *table[DISK_BUCKETS];
+static disk_entry_t *head;
+static disk_entry_t *tail;
+static size_t entries;
+static size_t bytes;
+static size_t budget;
+static pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hits;
+static unsigned long misses;
+static unsigned long stores;
+static unsigned long evictions;
+static unsigned long failures;
+static unsigned long expirations;
+
+static void path_of(unsigned long long id, char *out) {
+    snprintf(out, PATH_MAX, "%s/%016llx" DISK_SUFFIX, dir, id);
+}
+
+static disk_entry_t **bucket_of(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return &table[h % DISK_BUCKETS];
+}
+
+/* find_slot - the link pointing at key's entry, or at the chain's end */
+static disk_entry_t **find_slot(const char *key) {
+    disk_entry_t **pp = bucket_of(key);
+    while (*pp != NULL && strcmp((*pp)->key, key) != 0) {
+        pp = &(*pp)->hnext;
+    }
+    return pp;
+}
+
+static void lru_unlink(disk_entry_t *e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        tail = e->prev;
+    }
+    e->next = e->prev = NULL;
+}
+
+static void lru_push(disk_entry_t *e) {
+    e->prev = NULL;
+    e->next = head;
+    if (head != NULL) {
+        head->prev = e;
+    } else {
+        tail = e;
+    }
+    head = e;
+}
+
+/* drop - take an entry out of the index, caller holds diskLock */
+static void drop(disk_entry_t *e) {
+    disk_entry_t **pp = find_slot(e->key);
+    *pp = e->hnext;
+    lru_unlink(e);
+    entries--;
+    bytes -= e->size;
+}
+
+/* discard - delete a dropped entry's file and free it, with no lock held */
+static void discard(disk_entry_t *e) {
+    char path[PATH_MAX];
+    path_of(e->id, path);
+    unlink(path);
+    free(e->key);
+    free(e);
+}
+
+/* clear_dir - delete the files an earlier run left behind */
+static void clear_dir(void) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    size_t suffix = strlen(DISK_SUFFIX);
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len > suffix &&
+            strcmp(ent->d_name + len - suffix, DISK_SUFFIX) == 0) {
+            unlinkat(dirfd(d), ent->d_name, 0);
+        }
+    }
+    closedir(d);
+}
+
+bool disk_init(const char *path, size_t limit) {
+    if (strlen(path) >= sizeof(dir)) {
+        return false;
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        return false;
+    }
+    if (access(path, W_OK | X_OK) < 0) {
+        return false;
+    }
+    strcpy(dir, path);
+    clear_dir();
+    budget = limit;
+    enabled = true;
+    return true;
+}
+
+bool disk_enabled(void) {
+    return enabled;
+}
+
+int disk_open(const char *key, size_t *size, bool *keepAlive) {
+    pthread_mutex_lock(&diskLock);
+    disk_entry_t *e = *find_slot(key);
+    disk_entry_t *dead = NULL;
+    if (e != NULL && e->expires != 0 && e->expires <= time(NULL)) {
+        drop(e);
+        expirations++;
+        dead = e;
+        e = NULL;
+    }
+    unsigned long long id = 0;
+    if (e != NULL) {
+        lru_unlink(e);
+        lru_push(e);
+        id = e->id;
+        *size = e->size;
+        *keepAlive = e->keepAlive;
+    }
+    pthread_mutex_unlock(&diskLock);
+    if (dead != NULL) {
+        discard(dead);
+    }
+
+    // Opened with no lock held: if the entry was evicted meanwhile its file
+    // is gone and this is just a miss
+    int fd = -1;
+    if (e != NULL) {
+        char path[PATH_MAX];
+        path_of(id, path);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    __atomic_add_fetch(fd >= 0 ? &hits : &misses, 1, __ATOMIC_RELAXED);
+    return fd;
+}
+
+bool disk_spill_begin(disk_spill_t *spill, size_t size) {
+    if (!enabled || size > DISK_MAX_OBJECT_SIZE || size > budget) {
+        return false;
+    }
+    char path[PATH_MAX];
+    spill->id = __atomic_fetch_add(&nextId, 1, __ATOMIC_RELAXED);
+    spill->size = 0;
+    path_of(spill->id, path);
+    spill->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (spill->fd < 0) {
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void disk_spill_abort(disk_spill_t *spill) {
+    char path[PATH_MAX];
+    close(spill->fd);
+    path_of(spill->id, path);
+    unlink(path);
+}
+
+bool disk_spill_write(disk_spill_t *spill, const char *buf, size_t n) {
+    if (spill->size + n > DISK_MAX_OBJECT_SIZE || spill->size + n > budget) {
+        disk_spill_abort(spill);
+        return false;
+    }
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = write(spill->fd, buf + done, n - done);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+            disk_spill_abort(spill);
+            return false;
+        }
+        done += w;
+    }
+    spill->size += n;
+    return true;
+}
+
+void disk_spill_commit(disk_spill_t *spill, const char *key, bool keepAlive,
+                       time_t expires) {
+    close(spill->fd);
+    disk_entry_t *e = malloc(sizeof(disk_entry_t));
+    char *copy = strdup(key);
+    if (e == NULL || copy == NULL) {
+        free(e);
+        free(copy);
+        char path[PATH_MAX];
+        path_of(spill->id, path);
+        unlink(path);
+        return;
+    }
+    e->key = copy;
+    e->id = spill->id;
+    e->size = spill->size;
+    e->keepAlive = keepAlive;
+    e->expires = expires;
+
+    // Files are deleted after the lock is dropped
+    disk_entry_t *dropped = NULL;
+
+    pthread_mutex_lock(&diskLock);
+    disk_entry_t **slot = find_slot(key);
+    if (*slot != NULL) {
+        disk_entry_t *old = *slot;
+        drop(old);
+        old->next = dropped;
+        dropped = old;
+        slot = find_slot(key);
+    }
+    e->hnext = NULL;
+    *slot = e;
+    lru_push(e);
+    entries++;
+    bytes += e->size;
+    stores++;
+
+    while (bytes > budget && tail != e) {
+        disk_entry_t *victim = tail;
+        drop(victim);
+        victim->next = dropped;
+        dropped = victim;
+        evictions++;
+    }
+    pthread_mutex_unlock(&diskLock);
+
+    while (dropped != NULL) {
+        disk_entry_t *next = dropped->next;
+        discard(dropped);
+        dropped = next;
+    }
+}
+
+void disk_store(const char *key, const char *data, size_t size,
+                bool keepAlive, time_t expires) {
+    disk_spill_t spill;
+    if (disk_spill_begin(&spill, size) &&
+        disk_spill_write(&spill, data, size)) {
+        disk_spill_commit(&spill, key, keepAlive, expires);
+    }
+}
+
+void disk_stats(disk_stats_t *stats) {
+    pthread_mutex_lock(&diskLock);
+    stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+    stats->stores = stores;
+    stats->evictions = evictions;
+    stats->failures = __atomic_load_n(&failures, __ATOMIC_RELAXED);
+    stats->expirations = expirations;
+    stats->entries = entries;
+    stats->bytes = bytes;
+    stats->budget = budget;
+    pthread_mutex_unlock(&diskLock);
+}
@@ -0,0 +1,84 @@
+/*
+ * disk.h - optional second cache tier in a local directory
+ *
+ * Blocks evicted from the memory cache, and responses too large for it, are
+ * written to files in one directory (ideally a tmpfs) and indexed in memory
+ * by URI. A hit hands back an open descriptor that the caller sends with
+ * sendfile(), so the bytes go from the page cache to the socket without
+ * passing through the proxy. The tier keeps its own byte budget and evicts
+ * least recently used files when a new one would exceed it. A file keeps the
+ * expiry of the response it holds and is dropped, as a miss, once it is stale.
+ *
+ * The directory belongs to the proxy: files left over from an earlier run
+ * are deleted by disk_init().
+ */
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Bytes of responses kept on disk unless -b says otherwise */
+#define DISK_DEFAULT_BUDGET (64 * 1024 * 1024)
+/* Largest response the tier stores */
+#define DISK_MAX_OBJECT_SIZE (8 * 1024 * 1024)
+/* Hash buckets in the index */
+#define DISK_BUCKETS 4096
+
+/* A file being written, before it is indexed */
+typedef struct disk_spill {
+    int fd;
+    unsigned long long id; // names the file
+    size_t size;           // bytes written so far
+} disk_spill_t;
+
+/* Snapshot of the tier's counters */
+typedef struct disk_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;      // files indexed
+    unsigned long evictions;   // files dropped for the budget
+    unsigned long failures;    // files that could not be written
+    unsigned long expirations; // stale files dropped on lookup
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+} disk_stats_t;
+
+/*disk_init: serve the tier from dir with a budget in bytes; false if the
+  directory cannot be used, leaving the tier off*/
+bool disk_init(const char *dir, size_t budget);
+
+/*disk_enabled: true once disk_init has succeeded*/
+bool disk_enabled(void);
+
+/*disk_open: descriptor for the fresh response cached under key, with its
+  size and whether its head lets the client persist; -1 on a miss. The caller
+  closes it; the file stays readable even if it is evicted meanwhile*/
+int disk_open(const char *key, size_t *size, bool *keepAlive);
+
+/*disk_spill_begin: start a file for a response expected to be size bytes,
+  0 if unknown; false if it would not be kept or cannot be created*/
+bool disk_spill_begin(disk_spill_t *spill, size_t size);
+
+/*disk_spill_write: append to a spill; on failure, or once it outgrows
+  DISK_MAX_OBJECT_SIZE, the spill is abandoned and false returned*/
+bool disk_spill_write(disk_spill_t *spill, const char *buf, size_t n);
+
+/*disk_spill_commit: index a finished spill under key, stale from expires on
+  (0 for never)*/
+void disk_spill_commit(disk_spill_t *spill, const char *key, bool keepAlive,
+                       time_t expires);
+
+/*disk_spill_abort: throw a spill away*/
+void disk_spill_abort(disk_spill_t *spill);
+
+/*disk_store: write a whole response to the tier under key*/
+void disk_store(const char *key, const char *data, size_t size,
+                bool keepAlive, time_t expires);
+
+/*disk_stats: copy the current counters out*/
+void disk_stats(disk_stats_t *stats);
+
+#endif /* DISK_H */
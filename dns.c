@@ -0,0 +1,274 @@
+/*
+ * dns.c - TTL-bounded cache of resolved origin addresses
+ *
+ * Entries live in one hash table behind a mutex that is held only to copy an
+ * address list in or out; the resolver itself is always called unlocked, so
+ * a slow lookup for one host never stalls requests to another. Two threads
+ * missing on the same host may both resolve it, and the later answer wins.
+ */
+#define _GNU_SOURCE
+#include "dns.h"
+#include "csapp.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DNS_BUCKETS 256
+
+typedef struct dns_addr {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int family;
+    int socktype;
+    int protocol;
+} dns_addr_t;
+
+/* One host:port and what the resolver last said about it. */
+typedef struct dns_entry {
+    char *key;
+    int error; // getaddrinfo error for a negative entry, 0 otherwise
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    size_t naddrs;
+    time_t expires;
+    struct dns_entry *next;  // bucket chain
+    struct dns_entry *newer; // expiry order, within one of ages[]
+    struct dns_entry *older;
+} dns_entry_t;
+
+/* Entries in expiry order. Each list holds one TTL, resolved addresses or
+   failures, so updating an entry only ever moves it to the newest end */
+typedef struct dns_age {
+    dns_entry_t *oldest;
+    dns_entry_t *newest;
+} dns_age_t;
+
+static dns_entry_t *table[DNS_BUCKETS];
+static dns_age_t ages[2]; // [0] resolved, [1] failed
+static size_t entries;
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hits;
+static unsigned long negHits;
+static unsigned long misses;
+static unsigned long failures;
+
+static dns_entry_t **bucket_of(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return &table[h % DNS_BUCKETS];
+}
+
+static dns_entry_t *find_entry(dns_entry_t **slot, const char *key) {
+    for (dns_entry_t *e = *slot; e != NULL; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* age_unlink - take an entry off its expiry list */
+static void age_unlink(dns_entry_t *e) {
+    dns_age_t *age = &ages[e->error != 0];
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        age->oldest = e->newer;
+    }
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        age->newest = e->older;
+    }
+}
+
+/* age_push - queue an entry, just given its expiry, at the newest end */
+static void age_push(dns_entry_t *e) {
+    dns_age_t *age = &ages[e->error != 0];
+    e->newer = NULL;
+    e->older = age->newest;
+    if (age->newest != NULL) {
+        age->newest->newer = e;
+    } else {
+        age->oldest = e;
+    }
+    age->newest = e;
+}
+
+/*
+ * take_oldest - unlink and return the entry that expires first, an expired
+ *     one if there is any, to reuse for another host: the older of the two
+ *     lists' oldest entries. Caller holds tableLock.
+ */
+static dns_entry_t *take_oldest(void) {
+    dns_entry_t *ok = ages[0].oldest;
+    dns_entry_t *failed = ages[1].oldest;
+    dns_entry_t *e =
+        ok == NULL || (failed != NULL && failed->expires < ok->expires)
+            ? failed
+            : ok;
+    if (e == NULL) {
+        return NULL;
+    }
+    age_unlink(e);
+    dns_entry_t **p = bucket_of(e->key);
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    free(e->key);
+    return e;
+}
+
+/*
+ * definitive - returns true for resolver errors worth caching: the name or
+ *     service does not exist, as opposed to a resolver that is unreachable
+ */
+static bool definitive(int error) {
+#ifdef EAI_NODATA
+    if (error == EAI_NODATA) {
+        return true;
+    }
+#endif
+    return error == EAI_NONAME || error == EAI_SERVICE;
+}
+
+/* resolve - ask the resolver, copying at most DNS_MAX_ADDRS results out */
+static int resolve(const char *host, const char *port, dns_entry_t *out) {
+    struct addrinfo hints, *listp;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM; /* Open a connection */
+    hints.ai_flags = AI_NUMERICSERV; /* ... using a numeric port arg. */
+    hints.ai_flags |= AI_ADDRCONFIG; /* Recommended for connections */
+
+    __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+    int rc = getaddrinfo(host, port, &hints, &listp);
+    out->naddrs = 0;
+    out->error = rc;
+    if (rc != 0) {
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port,
+                gai_strerror(rc));
+        return rc;
+    }
+
+    for (struct addrinfo *p = listp; p && out->naddrs < DNS_MAX_ADDRS;
+         p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        dns_addr_t *a = &out->addrs[out->naddrs++];
+        memcpy(&a->addr, p->ai_addr, p->ai_addrlen);
+        a->addrlen = p->ai_addrlen;
+        a->family = p->ai_family;
+        a->socktype = p->ai_socktype;
+        a->protocol = p->ai_protocol;
+    }
+    freeaddrinfo(listp);
+    return 0;
+}
+
+/*
+ * lookup - fill res with the addresses of host:port, from the table when a
+ *     live entry exists. Returns 0 or the getaddrinfo error.
+ */
+static int lookup(const char *host, const char *port, dns_entry_t *res) {
+    char key[MAXLINE];
+    if (snprintf(key, sizeof(key), "%s:%s", host, port) >= (int)sizeof(key)) {
+        return resolve(host, port, res);
+    }
+    dns_entry_t **slot = bucket_of(key);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&tableLock);
+    dns_entry_t *e = find_entry(slot, key);
+    if (e != NULL && e->expires > now) {
+        res->error = e->error;
+        res->naddrs = e->naddrs;
+        memcpy(res->addrs, e->addrs, e->naddrs * sizeof(dns_addr_t));
+        pthread_mutex_unlock(&tableLock);
+        __atomic_add_fetch(res->error == 0 ? &hits : &negHits, 1,
+                           __ATOMIC_RELAXED);
+        return res->error;
+    }
+    pthread_mutex_unlock(&tableLock);
+
+    int rc = resolve(host, port, res);
+    if (rc != 0 && !definitive(rc)) {
+        return rc; // Resolver trouble: try again next time
+    }
+
+    pthread_mutex_lock(&tableLock);
+    e = find_entry(slot, key);
+    if (e != NULL) {
+        age_unlink(e);
+    } else {
+        // A full table gives up the entry closest to expiring, so hosts
+        // that never come back cannot keep new ones out for good
+        e = entries < DNS_MAX_ENTRIES ? NULL : take_oldest();
+        if (e == NULL) {
+            e = Malloc(sizeof(dns_entry_t));
+            entries++;
+        }
+        size_t keyLen = strlen(key) + 1;
+        e->key = Malloc(keyLen);
+        memcpy(e->key, key, keyLen);
+        e->next = *slot;
+        *slot = e;
+    }
+    e->error = rc;
+    e->naddrs = res->naddrs;
+    memcpy(e->addrs, res->addrs, res->naddrs * sizeof(dns_addr_t));
+    // stamped under the lock, so each list stays in expiry order
+    e->expires = time(NULL) + (rc == 0 ? DNS_TTL : DNS_NEGATIVE_TTL);
+    age_push(e);
+    pthread_mutex_unlock(&tableLock);
+    return rc;
+}
+
+int dns_connect(const char *host, const char *port) {
+    dns_entry_t res;
+    if (lookup(host, port, &res) != 0) {
+        return -2;
+    }
+
+    /* Walk the list for one that we can successfully connect to. The origin
+       is only to blame if every address turned the connection away */
+    bool refused = res.naddrs > 0;
+    for (size_t i = 0; i < res.naddrs; i++) {
+        dns_addr_t *a = &res.addrs[i];
+        int clientfd = socket(a->family, a->socktype, a->protocol);
+        if (clientfd < 0) {
+            refused = false;
+            continue; /* Socket failed, try the next */
+        }
+        if (connect(clientfd, (struct sockaddr *)&a->addr, a->addrlen) != -1) {
+            return clientfd;
+        }
+        if (errno != ECONNREFUSED && errno != ETIMEDOUT) {
+            refused = false;
+        }
+        close(clientfd);
+    }
+    return refused ? -1 : -3;
+}
+
+void dns_stats(dns_stats_t *stats) {
+    stats->hits = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+    stats->negHits = __atomic_load_n(&negHits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&failures, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&tableLock);
+    stats->entries = entries;
+    pthread_mutex_unlock(&tableLock);
+}
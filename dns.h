@@ -0,0 +1,43 @@
+/*
+ * dns.h - resolved-address cache in front of getaddrinfo
+ *
+ * Origin connects go through dns_connect(), which looks the host up in a
+ * small shared table before asking the resolver. Successful lookups are kept
+ * for DNS_TTL seconds and failures that the resolver reports as definitive
+ * (no such host or service) for DNS_NEGATIVE_TTL seconds, so a known host
+ * costs one hash probe and an unknown one cannot make every request wait on
+ * the resolver. getaddrinfo does not report record TTLs, so both are fixed.
+ */
+#ifndef DNS_H
+#define DNS_H
+
+#include <stddef.h>
+
+/* Seconds a resolved address list is reused */
+#define DNS_TTL 60
+/* Seconds a definitive lookup failure is remembered */
+#define DNS_NEGATIVE_TTL 10
+/* Addresses kept per host; getaddrinfo results past this are dropped */
+#define DNS_MAX_ADDRS 8
+/* Hosts tracked at once; past this a new host takes the entry closest to
+   expiring */
+#define DNS_MAX_ENTRIES 1024
+
+/* Snapshot of the lookup counters */
+typedef struct dns_stats {
+    unsigned long hits;     // answered from a cached address list
+    unsigned long negHits;  // answered from a cached failure
+    unsigned long misses;   // sent to the resolver
+    unsigned long failures; // resolver calls that failed
+    size_t entries;         // hosts currently in the table
+} dns_stats_t;
+
+/*dns_connect: like open_clientfd, but resolves through the cache; returns
+  -2 if the host does not resolve, -1 if every address refused the connection
+  or timed out, and -3 for any other failure, such as running out of fds*/
+int dns_connect(const char *host, const char *port);
+
+/*dns_stats: copy the current counters out*/
+void dns_stats(dns_stats_t *stats);
+
+#endif /* DNS_H */
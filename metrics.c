@@ -0,0 +1,196 @@
+/*
+ * metrics.c - cache-line-padded per-thread slots, summed on demand
+ */
+#include "metrics.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static metrics_slot_t slots[METRICS_MAX_THREADS];
+static size_t claimed; // slots handed out, may run past METRICS_MAX_THREADS
+
+static __thread metrics_slot_t *mine;
+static __thread bool shared; // mine is the last slot, shared by latecomers
+
+static const char *const counterNames[METRIC_COUNT] = {
+    "requests",    "hits",           "misses",     "evictions",
+    "bytes_cache", "bytes_upstream", "connections"};
+static const char *const phaseNames[PHASE_COUNT] = {"parse", "connect",
+                                                    "first_byte", "total"};
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+static const char *const quantileNames[] = {"p50", "p90", "p99", "p999"};
+#define QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+/* slot - the calling thread's slot, claimed on first use */
+static metrics_slot_t *slot(void) {
+    if (mine == NULL) {
+        size_t i = __atomic_fetch_add(&claimed, 1, __ATOMIC_RELAXED);
+        shared = i >= METRICS_MAX_THREADS - 1;
+        mine = &slots[shared ? METRICS_MAX_THREADS - 1 : i];
+    }
+    return mine;
+}
+
+/* bump - add n to a slot field: a plain store from its only writer, an
+   atomic add on the shared slot */
+static void bump(uint64_t *field, uint64_t n) {
+    if (shared) {
+        __atomic_add_fetch(field, n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(field, __atomic_load_n(field, __ATOMIC_RELAXED) + n,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+/* bucket_of - histogram bucket of a value: exact below 2 * METRICS_SUB, then
+   METRICS_SUB buckets for each power of two */
+static size_t bucket_of(uint64_t v) {
+    if (v < METRICS_SUB) {
+        return v;
+    }
+    int shift = 63 - __builtin_clzll(v) - METRICS_SUB_BITS;
+    size_t i = (size_t)(shift + 1) * METRICS_SUB +
+               ((v >> shift) & (METRICS_SUB - 1));
+    return i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1;
+}
+
+/* bucket_top - the highest value that lands in bucket i */
+static uint64_t bucket_top(size_t i) {
+    if (i < METRICS_SUB) {
+        return i;
+    }
+    int shift = i / METRICS_SUB - 1;
+    uint64_t low = (uint64_t)(METRICS_SUB + i % METRICS_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_add(metric_t metric, int64_t n) {
+    bump((uint64_t *)&slot()->counters[metric], (uint64_t)n);
+}
+
+void metrics_time(phase_t phase, uint64_t start) {
+    uint64_t now = metrics_now();
+    uint64_t v = now > start ? now - start : 0;
+    metrics_slot_t *s = slot();
+    bump(&s->buckets[phase][bucket_of(v)], 1);
+    bump(&s->sums[phase], v);
+    if (v > __atomic_load_n(&s->maxes[phase], __ATOMIC_RELAXED)) {
+        // a racing larger maximum on the shared slot may be lost; the
+        // histogram still has it
+        __atomic_store_n(&s->maxes[phase], v, __ATOMIC_RELAXED);
+    }
+}
+
+/* A phase's summed histogram and what the report says about it */
+typedef struct phase_sum {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t at[QUANTILES];
+} phase_sum_t;
+
+/* sum_phase - add up one phase over the n slots in use */
+static void sum_phase(phase_t phase, size_t n, phase_sum_t *p) {
+    memset(p, 0, sizeof(*p));
+    for (size_t s = 0; s < n; s++) {
+        for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+            uint64_t c =
+                __atomic_load_n(&slots[s].buckets[phase][i], __ATOMIC_RELAXED);
+            p->buckets[i] += c;
+            p->count += c;
+        }
+        p->sum += __atomic_load_n(&slots[s].sums[phase], __ATOMIC_RELAXED);
+        uint64_t max =
+            __atomic_load_n(&slots[s].maxes[phase], __ATOMIC_RELAXED);
+        p->max = max > p->max ? max : p->max;
+    }
+
+    uint64_t seen = 0;
+    size_t q = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS && q < QUANTILES; i++) {
+        seen += p->buckets[i];
+        while (q < QUANTILES && p->count > 0 &&
+               seen >= quantiles[q] * p->count) {
+            uint64_t top = bucket_top(i);
+            p->at[q++] = top < p->max ? top : p->max;
+        }
+    }
+}
+
+size_t metrics_report(char *buf, size_t n, bool json,
+                      const cache_stats_t *cache) {
+    size_t used = __atomic_load_n(&claimed, __ATOMIC_RELAXED);
+    used = used < METRICS_MAX_THREADS ? used : METRICS_MAX_THREADS;
+
+    int64_t counters[METRIC_COUNT] = {0};
+    for (size_t s = 0; s < used; s++) {
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            counters[m] +=
+                __atomic_load_n(&slots[s].counters[m], __ATOMIC_RELAXED);
+        }
+    }
+    int64_t lookups = counters[METRIC_HITS] + counters[METRIC_MISSES];
+    double ratio = lookups > 0 ? (double)counters[METRIC_HITS] / lookups : 0;
+
+    size_t len = 0;
+#define EMIT(...)                                                              \
+    do {                                                                       \
+        if (len < n) {                                                         \
+            len += snprintf(buf + len, n - len, __VA_ARGS__);                  \
+        }                                                                      \
+    } while (0)
+
+    EMIT(json ? "{" : "");
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        EMIT(json ? "\"%s\":%lld," : "%s %lld\n", counterNames[m],
+             (long long)counters[m]);
+    }
+    EMIT(json ? "\"hit_ratio\":%.4f,\"latency_us\":{" : "hit_ratio %.4f\n",
+         ratio);
+
+    phase_sum_t p;
+    for (int ph = 0; ph < PHASE_COUNT; ph++) {
+        sum_phase(ph, used, &p);
+        unsigned long long mean = p.count > 0 ? p.sum / p.count : 0;
+        EMIT(json ? "%s\"%s\":{\"count\":%llu,\"mean\":%llu"
+                  : "%s%s_us count %llu mean %llu",
+             json && ph > 0 ? "," : "", phaseNames[ph],
+             (unsigned long long)p.count, mean);
+        for (size_t q = 0; q < QUANTILES; q++) {
+            EMIT(json ? ",\"%s\":%llu" : " %s %llu", quantileNames[q],
+                 (unsigned long long)p.at[q]);
+        }
+        EMIT(json ? ",\"max\":%llu}" : " max %llu\n",
+             (unsigned long long)p.max);
+    }
+    EMIT(json ? "}" : "");
+
+    if (cache != NULL) {
+        const char *names[] = {"inserts",     "evictions",  "rejections",
+                               "expirations", "stale_hits", "revalidations"};
+        unsigned long values[] = {cache->inserts,    cache->evictions,
+                                  cache->rejections, cache->expirations,
+                                  cache->staleHits,  cache->revalidations};
+        EMIT(json ? ",\"cache\":{\"policy\":\"%s\",\"size\":%zu"
+                  : "cache_policy %s\ncache_size %zu\n",
+             cache->policy, cache->size);
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            EMIT(json ? ",\"%s\":%lu" : "cache_%s %lu\n", names[i],
+                 values[i]);
+        }
+        EMIT(json ? "}" : "");
+    }
+    EMIT(json ? "}\n" : "");
+#undef EMIT
+
+    return len < n ? len : n - 1;
+}
@@ -0,0 +1,86 @@
+/*
+ * metrics.h - per-thread counters and latency histograms
+ *
+ * Every thread that records anything gets a slot of its own, aligned to a
+ * cache line so no two threads ever write the same line. A slot's owner
+ * updates it with plain relaxed stores, so counting costs no lock and no
+ * locked instruction; threads beyond METRICS_MAX_THREADS share one last slot
+ * and add to it atomically. A report sums every slot with relaxed loads
+ * while the workers carry on, so it is a close, not an exact, snapshot.
+ *
+ * Latencies are kept in microseconds in log-linear histograms, HDR style:
+ * each power of two is split into METRICS_SUB equal buckets, so a reported
+ * percentile is within 1/METRICS_SUB of the true value at any magnitude, from
+ * a microsecond up to hours, in a fixed number of buckets.
+ *
+ * The report is served to clients that ask the proxy for METRICS_PATH, as
+ * text or, with ?format=json, as JSON.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct cache_stats;
+
+/* Path of the proxy's own stats page */
+#define METRICS_PATH "/__proxy/stats"
+/* Threads with a slot of their own */
+#define METRICS_MAX_THREADS 256
+/* Bytes per cache line, which slots are aligned to */
+#define METRICS_LINE 64
+/* Buckets per power of two in a histogram */
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+/* Powers of two above METRICS_SUB a histogram covers, up to about 19 hours;
+   longer latencies land in the last bucket */
+#define METRICS_MAGNITUDES 33
+#define METRICS_BUCKETS ((METRICS_MAGNITUDES + 1) * METRICS_SUB)
+
+/* Counters and gauges */
+typedef enum {
+    METRIC_REQUESTS,       // requests served, the stats page included
+    METRIC_HITS,           // answered without going to the origin
+    METRIC_MISSES,         // answered from the origin
+    METRIC_EVICTIONS,      // blocks evicted from the memory cache
+    METRIC_BYTES_CACHE,    // response bytes sent from the proxy's stores
+    METRIC_BYTES_UPSTREAM, // response bytes relayed from origins
+    METRIC_CONNECTIONS,    // client connections open, a gauge
+    METRIC_COUNT
+} metric_t;
+
+/* Phases of a request that are timed */
+typedef enum {
+    PHASE_PARSE,      // parsing the request head
+    PHASE_CONNECT,    // getting an origin connection, pooled or new
+    PHASE_FIRST_BYTE, // from sending the origin the request to its first byte
+    PHASE_TOTAL,      // the whole request, from parse to last byte sent
+    PHASE_COUNT
+} phase_t;
+
+/* One thread's counters and histograms */
+typedef struct metrics_slot {
+    int64_t counters[METRIC_COUNT];
+    uint64_t sums[PHASE_COUNT]; // microseconds
+    uint64_t maxes[PHASE_COUNT];
+    uint64_t buckets[PHASE_COUNT][METRICS_BUCKETS];
+} __attribute__((aligned(METRICS_LINE))) metrics_slot_t;
+
+/*metrics_now: microseconds on the monotonic clock*/
+uint64_t metrics_now(void);
+
+/*metrics_add: add n, which may be negative for a gauge, to a counter*/
+void metrics_add(metric_t metric, int64_t n);
+
+/*metrics_time: record that a phase took the microseconds since start*/
+void metrics_time(phase_t phase, uint64_t start);
+
+/*metrics_report: write the summed counters, each phase's count, mean,
+  percentiles and maximum, and the cache policy's counters from cache if not
+  NULL into buf as text, or as JSON if json; returns the length written*/
+size_t metrics_report(char *buf, size_t n, bool json,
+                      const struct cache_stats *cache);
+
+#endif /* METRICS_H */
@@ -0,0 +1,220 @@
+/*
+ * negative.c - budgeted, TTL-bounded cache of failed fetches
+ *
+ * Entries live in one hash table behind a mutex, and on a list in the order
+ * they were stored. Error pages are small, so a hit copies the response out
+ * under the lock rather than pinning the entry. Storing past the budget
+ * drops the oldest entries first; since every entry lives a few seconds at
+ * most, the oldest is also the closest to expiring. Expired entries are
+ * dropped when a lookup runs into them.
+ */
+#include "negative.h"
+#include "csapp.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NEGATIVE_BUCKETS 256
+
+/* One error response, or one origin that refused a connection. */
+typedef struct neg_entry {
+    char *key;      // the URI, or host:port of a down origin
+    bool down;      // an origin rather than a response
+    char *data;     // the response, after the key in the same allocation
+    size_t size;
+    bool keepAlive; // the response head lets the client persist
+    time_t expires;
+    size_t bytes;   // charged to the budget
+    struct neg_entry *hnext; // next entry in the same bucket
+    struct neg_entry *newer; // store order, oldest at the list head
+    struct neg_entry *older;
+} neg_entry_t;
+
+static neg_entry_t *table[NEGATIVE_BUCKETS];
+static neg_entry_t *oldest;
+static neg_entry_t *newest;
+static size_t entries;
+static size_t bytes;
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hits;
+static unsigned long downHits;
+static unsigned long stores;
+static unsigned long evictions;
+
+static neg_entry_t **bucket_of(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return &table[h % NEGATIVE_BUCKETS];
+}
+
+/* drop_entry - unlink e from its bucket and the store order, and free it */
+static void drop_entry(neg_entry_t *e) {
+    neg_entry_t **p = bucket_of(e->key);
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+
+    if (e->older != NULL) {
+        e->older->newer = e->newer;
+    } else {
+        oldest = e->newer;
+    }
+    if (e->newer != NULL) {
+        e->newer->older = e->older;
+    } else {
+        newest = e->older;
+    }
+    entries--;
+    bytes -= e->bytes;
+    free(e);
+}
+
+/*
+ * find_live - the unexpired entry for key, dropping an expired one found on
+ *     the way; caller holds tableLock
+ */
+static neg_entry_t *find_live(const char *key, bool down, time_t now) {
+    for (neg_entry_t *e = *bucket_of(key); e != NULL; e = e->hnext) {
+        if (e->down == down && strcmp(e->key, key) == 0) {
+            if (e->expires > now) {
+                return e;
+            }
+            drop_entry(e);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * store - keep a copy of data under key until expires, replacing an older
+ *     entry for it and dropping the oldest entries to stay in the budget
+ */
+static void store(const char *key, bool down, const char *data, size_t size,
+                  bool keepAlive, time_t expires) {
+    size_t keyLen = strlen(key) + 1;
+    size_t cost = sizeof(neg_entry_t) + keyLen + size;
+    neg_entry_t *e = malloc(cost);
+    if (e == NULL) {
+        return;
+    }
+    e->key = (char *)(e + 1);
+    e->data = e->key + keyLen;
+    memcpy(e->key, key, keyLen);
+    if (size > 0) {
+        memcpy(e->data, data, size);
+    }
+    e->down = down;
+    e->size = size;
+    e->keepAlive = keepAlive;
+    e->expires = expires;
+    e->bytes = cost;
+
+    pthread_mutex_lock(&tableLock);
+    neg_entry_t *old = find_live(key, down, time(NULL));
+    if (old != NULL) {
+        drop_entry(old);
+    }
+    while (oldest != NULL && bytes + cost > NEGATIVE_BUDGET) {
+        drop_entry(oldest);
+        evictions++;
+    }
+    neg_entry_t **slot = bucket_of(key);
+    e->hnext = *slot;
+    *slot = e;
+    e->newer = NULL;
+    e->older = newest;
+    if (newest != NULL) {
+        newest->newer = e;
+    } else {
+        oldest = e;
+    }
+    newest = e;
+    entries++;
+    bytes += cost;
+    stores++;
+    pthread_mutex_unlock(&tableLock);
+}
+
+/* origin_key - host:port into key; false if it does not fit */
+static bool origin_key(const char *host, const char *port, char *key,
+                       size_t n) {
+    return snprintf(key, n, "%s:%s", host, port) < (int)n;
+}
+
+bool negative_find(const char *uri, char *buf, size_t *size,
+                   bool *keepAlive) {
+    pthread_mutex_lock(&tableLock);
+    neg_entry_t *e = find_live(uri, false, time(NULL));
+    if (e != NULL) {
+        memcpy(buf, e->data, e->size);
+        *size = e->size;
+        *keepAlive = e->keepAlive;
+        hits++;
+    }
+    pthread_mutex_unlock(&tableLock);
+    return e != NULL;
+}
+
+bool negative_cacheable(int status, bool explicit) {
+    switch (status) {
+    case 404: // Not Found
+    case 405: // Method Not Allowed
+    case 410: // Gone
+    case 414: // URI Too Long
+        return true;
+    default:
+        return explicit;
+    }
+}
+
+void negative_store(const char *uri, const char *data, size_t size,
+                    bool keepAlive, time_t expires) {
+    time_t now = time(NULL);
+    if (size > NEGATIVE_MAX_OBJECT || (expires != 0 && expires <= now)) {
+        return;
+    }
+    if (expires == 0 || expires > now + NEGATIVE_TTL) {
+        expires = now + NEGATIVE_TTL;
+    }
+    store(uri, false, data, size, keepAlive, expires);
+}
+
+bool negative_down(const char *host, const char *port) {
+    char key[MAXLINE];
+    if (!origin_key(host, port, key, sizeof(key))) {
+        return false;
+    }
+    pthread_mutex_lock(&tableLock);
+    bool down = find_live(key, true, time(NULL)) != NULL;
+    if (down) {
+        downHits++;
+    }
+    pthread_mutex_unlock(&tableLock);
+    return down;
+}
+
+void negative_mark_down(const char *host, const char *port) {
+    char key[MAXLINE];
+    if (origin_key(host, port, key, sizeof(key))) {
+        store(key, true, NULL, 0, false, time(NULL) + NEGATIVE_DOWN_TTL);
+    }
+}
+
+void negative_stats(negative_stats_t *stats) {
+    pthread_mutex_lock(&tableLock);
+    stats->hits = hits;
+    stats->downHits = downHits;
+    stats->stores = stores;
+    stats->evictions = evictions;
+    stats->entries = entries;
+    stats->bytes = bytes;
+    pthread_mutex_unlock(&tableLock);
+}
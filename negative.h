@@ -0,0 +1,66 @@
+/*
+ * negative.h - short-lived memory of failed fetches
+ *
+ * Error responses (status 400 and up) are not cached with real content.
+ * Those that say something lasting about the URI (404, 405, 410 and 414),
+ * and any other whose origin gave it explicit freshness, are kept here for
+ * at most NEGATIVE_TTL seconds, so a client retrying a missing object is
+ * answered without a trip to the origin. A passing failure, such as a 5xx
+ * with no Cache-Control or Expires, is never reused. An origin that
+ * could not be connected to is remembered for NEGATIVE_DOWN_TTL seconds,
+ * and requests for it fail at once instead of waiting on another connect.
+ * Entries share a NEGATIVE_BUDGET byte budget of their own and are dropped
+ * oldest first, so they can never push positive content out of the cache.
+ * Host lookups that fail are remembered by dns.c.
+ */
+#ifndef NEGATIVE_H
+#define NEGATIVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Longest an error response is reused, in seconds */
+#define NEGATIVE_TTL 10
+/* Seconds an origin that refused a connection is not retried */
+#define NEGATIVE_DOWN_TTL 5
+/* Bytes of keys, responses and bookkeeping kept at once */
+#define NEGATIVE_BUDGET (64 * 1024)
+/* Largest error response kept; bigger ones are always fetched */
+#define NEGATIVE_MAX_OBJECT (NEGATIVE_BUDGET / 8)
+
+/* Snapshot of the negative cache counters */
+typedef struct negative_stats {
+    unsigned long hits;      // error responses answered from the cache
+    unsigned long downHits;  // requests failed because the origin was down
+    unsigned long stores;    // error responses and connect failures kept
+    unsigned long evictions; // entries dropped for the budget
+    size_t entries;
+    size_t bytes;
+} negative_stats_t;
+
+/*negative_find: copy the error response cached for uri into buf, which
+  holds NEGATIVE_MAX_OBJECT bytes; false if there is none*/
+bool negative_find(const char *uri, char *buf, size_t *size,
+                   bool *keepAlive);
+
+/*negative_cacheable: true if an error response with this status may be
+  kept; explicit says its head gave a lifetime with Cache-Control or
+  Expires*/
+bool negative_cacheable(int status, bool explicit);
+
+/*negative_store: keep an error response for uri until expires, or for
+  NEGATIVE_TTL if that is sooner or expires is 0*/
+void negative_store(const char *uri, const char *data, size_t size,
+                    bool keepAlive, time_t expires);
+
+/*negative_down: true if host:port recently refused a connection*/
+bool negative_down(const char *host, const char *port);
+
+/*negative_mark_down: remember that host:port could not be connected to*/
+void negative_mark_down(const char *host, const char *port);
+
+/*negative_stats: copy the current counters out*/
+void negative_stats(negative_stats_t *stats);
+
+#endif /* NEGATIVE_H */
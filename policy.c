@@ -0,0 +1,400 @@
+/*
+ * policy.c - LRU, CLOCK, SLRU, S3-FIFO, ARC and GDSF over the shard lists
+ *
+ * The queue policies evict from list tails and queue at list heads, stamping
+ * the block with the cache clock as they do; GDSF ranks blocks in a heap
+ * instead. After any change a policy publishes the stamp of the block it
+ * would evict next; for the policies that give blocks a second chance that
+ * block may yet be spared, so cross-shard order is only approximate for
+ * them.
+ */
+#include "policy.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* publish - tell eviction how old this shard's next victim is */
+static void publish(shard_t *shard, block_t *next) {
+    __atomic_store_n(&shard->oldest, next != NULL ? next->lastUse : UINT64_MAX,
+                     __ATOMIC_RELAXED);
+}
+
+/* queue - stamp a block and put it at the head of list i */
+static void queue(cache_t *cache, shard_t *shard, int i, block_t *block) {
+    block->lastUse = cache_tick(cache);
+    list_push(shard, i, block);
+}
+
+/* requeue - move a linked block to the head of list i */
+static void requeue(cache_t *cache, shard_t *shard, int i, block_t *block) {
+    list_unlink(shard, block);
+    queue(cache, shard, i, block);
+}
+
+/* unqueue - take a block off its list outside eviction; it leaves no ghost,
+ * since it was not evicted too early */
+static void unqueue(cache_t *cache, shard_t *shard, block_t *block) {
+    list_unlink(shard, block);
+    publish(shard, cache->policy->next(shard));
+}
+
+/* ghost_max - ghosts kept per list: about as many as there are blocks */
+static size_t ghost_max(shard_t *shard) {
+    return shard->numBlock > 16 ? shard->numBlock : 16;
+}
+
+/*
+ * LRU - one list, hits move to the head.
+ */
+static block_t *lru_next(shard_t *shard) {
+    return shard->lists[0].tail;
+}
+
+static void lru_hit(cache_t *cache, shard_t *shard, block_t *block) {
+    requeue(cache, shard, 0, block);
+    publish(shard, lru_next(shard));
+}
+
+static void lru_admit(cache_t *cache, shard_t *shard, block_t *block) {
+    queue(cache, shard, 0, block);
+    publish(shard, lru_next(shard));
+}
+
+static block_t *lru_victim(cache_t *cache, shard_t *shard) {
+    (void)cache;
+    block_t *block = shard->lists[0].tail;
+    if (block != NULL) {
+        list_unlink(shard, block);
+    }
+    publish(shard, lru_next(shard));
+    return block;
+}
+
+const policy_t policy_lru = {"lru", false, lru_hit, lru_admit, lru_victim,
+                             lru_next, unqueue};
+
+/*
+ * CLOCK - second chance: a hit only sets the block's reference bit, and the
+ *     hand (the list tail) requeues referenced blocks with the bit cleared
+ *     instead of evicting them.
+ */
+static void clock_hit(cache_t *cache, shard_t *shard, block_t *block) {
+    (void)cache;
+    (void)shard;
+    __atomic_store_n(&block->freq, 1, __ATOMIC_RELAXED);
+}
+
+static block_t *clock_victim(cache_t *cache, shard_t *shard) {
+    block_t *block;
+    while ((block = shard->lists[0].tail) != NULL &&
+           __atomic_load_n(&block->freq, __ATOMIC_RELAXED) != 0) {
+        block->freq = 0;
+        requeue(cache, shard, 0, block);
+    }
+    if (block != NULL) {
+        list_unlink(shard, block);
+    }
+    publish(shard, lru_next(shard));
+    return block;
+}
+
+const policy_t policy_clock = {"clock", true, clock_hit, lru_admit,
+                               clock_victim, lru_next, unqueue};
+
+/*
+ * SLRU - new blocks start on probation (list 0); a hit there promotes them to
+ *     the protected list (list 1), which holds at most 80% of the shard and
+ *     demotes its own LRU blocks back to probation when it overflows.
+ */
+static block_t *slru_next(shard_t *shard) {
+    block_t *block = shard->lists[0].tail;
+    return block != NULL ? block : shard->lists[1].tail;
+}
+
+static void slru_hit(cache_t *cache, shard_t *shard, block_t *block) {
+    requeue(cache, shard, 1, block);
+
+    size_t protectedMax = shard->capacity / 5 * 4;
+    while (shard->lists[1].size > protectedMax &&
+           shard->lists[1].tail != block) {
+        requeue(cache, shard, 0, shard->lists[1].tail);
+    }
+    publish(shard, slru_next(shard));
+}
+
+static void slru_admit(cache_t *cache, shard_t *shard, block_t *block) {
+    queue(cache, shard, 0, block);
+    publish(shard, slru_next(shard));
+}
+
+static block_t *slru_victim(cache_t *cache, shard_t *shard) {
+    (void)cache;
+    block_t *block = slru_next(shard);
+    if (block != NULL) {
+        list_unlink(shard, block);
+    }
+    publish(shard, slru_next(shard));
+    return block;
+}
+
+const policy_t policy_slru = {"slru", false, slru_hit, slru_admit,
+                              slru_victim, slru_next, unqueue};
+
+/*
+ * S3-FIFO - a small FIFO (list 0, 10% of the shard) filters one-hit wonders
+ *     out before they reach the main FIFO (list 1). Hits only bump a 2-bit
+ *     counter. Blocks leaving the small queue move to main if they were hit,
+ *     otherwise their key is remembered in ghosts[0] and a later miss on it
+ *     is admitted straight to main. Main gives hit blocks another lap,
+ *     decrementing their counter each time.
+ */
+#define S3FIFO_MAX_FREQ 3
+
+static bool s3fifo_from_small(shard_t *shard) {
+    return shard->lists[0].tail != NULL &&
+           (shard->lists[0].size > shard->capacity / 10 ||
+            shard->lists[1].tail == NULL);
+}
+
+static block_t *s3fifo_next(shard_t *shard) {
+    return s3fifo_from_small(shard) ? shard->lists[0].tail
+                                    : shard->lists[1].tail;
+}
+
+static void s3fifo_hit(cache_t *cache, shard_t *shard, block_t *block) {
+    (void)cache;
+    (void)shard;
+    // a lost update between racing readers only costs one count
+    uint8_t freq = __atomic_load_n(&block->freq, __ATOMIC_RELAXED);
+    if (freq < S3FIFO_MAX_FREQ) {
+        __atomic_store_n(&block->freq, freq + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void s3fifo_admit(cache_t *cache, shard_t *shard, block_t *block) {
+    queue(cache, shard, ghost_take(shard, 0, block->hash) ? 1 : 0, block);
+    publish(shard, s3fifo_next(shard));
+}
+
+static block_t *s3fifo_victim(cache_t *cache, shard_t *shard) {
+    block_t *block;
+    while ((block = s3fifo_next(shard)) != NULL) {
+        if (block->freq == 0) {
+            list_unlink(shard, block);
+            if (block->list == 0) {
+                ghost_add(shard, 0, block->hash, ghost_max(shard));
+            }
+            break;
+        }
+        if (block->list == 0) {
+            block->freq = 0;
+            requeue(cache, shard, 1, block);
+        } else {
+            block->freq--;
+            requeue(cache, shard, 1, block);
+        }
+    }
+    publish(shard, s3fifo_next(shard));
+    return block;
+}
+
+const policy_t policy_s3fifo = {"s3fifo", true, s3fifo_hit, s3fifo_admit,
+                                s3fifo_victim, s3fifo_next, unqueue};
+
+/*
+ * ARC - T1 (list 0) holds blocks seen once, T2 (list 1) blocks seen again.
+ *     Ghost lists B1 and B2 remember keys evicted from each; a miss that hits
+ *     a ghost shifts the target size of T1 (shard->target, in bytes) toward
+ *     the list that would have kept it.
+ */
+static bool arc_from_t1(shard_t *shard) {
+    return shard->lists[0].tail != NULL &&
+           (shard->lists[0].size > shard->target ||
+            shard->lists[1].tail == NULL);
+}
+
+static block_t *arc_next(shard_t *shard) {
+    return arc_from_t1(shard) ? shard->lists[0].tail : shard->lists[1].tail;
+}
+
+static void arc_hit(cache_t *cache, shard_t *shard, block_t *block) {
+    requeue(cache, shard, 1, block);
+    publish(shard, arc_next(shard));
+}
+
+static void arc_admit(cache_t *cache, shard_t *shard, block_t *block) {
+    size_t b1 = shard->ghosts[0].count;
+    size_t b2 = shard->ghosts[1].count;
+
+    if (ghost_take(shard, 0, block->hash)) {
+        size_t step = (b1 != 0 && b2 > b1 ? b2 / b1 : 1) * block->blockSize;
+        shard->target = shard->capacity - shard->target > step
+                            ? shard->target + step
+                            : shard->capacity;
+        queue(cache, shard, 1, block);
+    } else if (ghost_take(shard, 1, block->hash)) {
+        size_t step = (b2 != 0 && b1 > b2 ? b1 / b2 : 1) * block->blockSize;
+        shard->target = shard->target > step ? shard->target - step : 0;
+        queue(cache, shard, 1, block);
+    } else {
+        queue(cache, shard, 0, block);
+    }
+    publish(shard, arc_next(shard));
+}
+
+static block_t *arc_victim(cache_t *cache, shard_t *shard) {
+    (void)cache;
+    block_t *block = arc_next(shard);
+    if (block != NULL) {
+        list_unlink(shard, block);
+        ghost_add(shard, block->list, block->hash, ghost_max(shard));
+    }
+    publish(shard, arc_next(shard));
+    return block;
+}
+
+const policy_t policy_arc = {"arc", false, arc_hit, arc_admit, arc_victim,
+                             arc_next, unqueue};
+
+/*
+ * GDSF - GreedyDual-Size-Frequency: each block is worth
+ *     inflation + freq * cost / size, so small, popular blocks that were slow
+ *     to fetch stay longest. The cheapest block goes first, and its value
+ *     becomes the shard's inflation, which newer blocks start from so that
+ *     blocks that stop being hit age out. Blocks sit in a per-shard binary
+ *     min-heap; list 0 only keeps them linked for the rest of the cache.
+ *     A block's published stamp is the bit pattern of its priority, which
+ *     orders like the value itself because priorities are never negative.
+ */
+static void heap_set(shard_t *shard, size_t i, block_t *block) {
+    shard->heap[i] = block;
+    block->heapIndex = i;
+}
+
+static void sift_up(shard_t *shard, size_t i) {
+    block_t *block = shard->heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (shard->heap[parent]->priority <= block->priority) {
+            break;
+        }
+        heap_set(shard, i, shard->heap[parent]);
+        i = parent;
+    }
+    heap_set(shard, i, block);
+}
+
+static void sift_down(shard_t *shard, size_t i) {
+    block_t *block = shard->heap[i];
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= shard->heapLen) {
+            break;
+        }
+        if (child + 1 < shard->heapLen &&
+            shard->heap[child + 1]->priority < shard->heap[child]->priority) {
+            child++;
+        }
+        if (block->priority <= shard->heap[child]->priority) {
+            break;
+        }
+        heap_set(shard, i, shard->heap[child]);
+        i = child;
+    }
+    heap_set(shard, i, block);
+}
+
+static block_t *gdsf_next(shard_t *shard) {
+    return shard->heapLen > 0 ? shard->heap[0] : NULL;
+}
+
+/* gdsf_rank - recompute a block's priority and its stamp */
+static void gdsf_rank(shard_t *shard, block_t *block) {
+    block->priority = shard->inflation +
+                      (double)block->freq * block->cost / block->blockSize;
+    memcpy(&block->lastUse, &block->priority, sizeof(block->lastUse));
+}
+
+static void gdsf_hit(cache_t *cache, shard_t *shard, block_t *block) {
+    (void)cache;
+    if (block->freq < UINT8_MAX) {
+        block->freq++;
+    }
+    gdsf_rank(shard, block);
+    sift_down(shard, block->heapIndex); // priorities only grow on a hit
+    publish(shard, gdsf_next(shard));
+}
+
+static void gdsf_admit(cache_t *cache, shard_t *shard, block_t *block) {
+    (void)cache;
+    if (shard->heapLen == shard->heapCap) {
+        size_t cap = shard->heapCap ? shard->heapCap * 2 : 64;
+        block_t **heap = realloc(shard->heap, cap * sizeof(block_t *));
+        if (heap == NULL) {
+            printf("Error growing heap");
+            exit(1);
+        }
+        shard->heap = heap;
+        shard->heapCap = cap;
+    }
+    block->freq = 1;
+    gdsf_rank(shard, block);
+    list_push(shard, 0, block);
+    heap_set(shard, shard->heapLen++, block);
+    sift_up(shard, block->heapIndex);
+    publish(shard, gdsf_next(shard));
+}
+
+/* heap_remove - take a block out of the heap, filling its place with the
+ * last one */
+static void heap_remove(shard_t *shard, block_t *block) {
+    size_t i = block->heapIndex;
+    block_t *last = shard->heap[--shard->heapLen];
+    if (last != block) {
+        heap_set(shard, i, last);
+        sift_up(shard, i);
+        sift_down(shard, last->heapIndex);
+    }
+}
+
+static block_t *gdsf_victim(cache_t *cache, shard_t *shard) {
+    (void)cache;
+    block_t *block = gdsf_next(shard);
+    if (block != NULL) {
+        shard->inflation = block->priority;
+        list_unlink(shard, block);
+        heap_remove(shard, block);
+    }
+    publish(shard, gdsf_next(shard));
+    return block;
+}
+
+/* gdsf_remove - a block leaving early does not move the inflation */
+static void gdsf_remove(cache_t *cache, shard_t *shard, block_t *block) {
+    (void)cache;
+    list_unlink(shard, block);
+    heap_remove(shard, block);
+    publish(shard, gdsf_next(shard));
+}
+
+const policy_t policy_gdsf = {"gdsf", false, gdsf_hit, gdsf_admit,
+                              gdsf_victim, gdsf_next, gdsf_remove};
+
+static const policy_t *const policies[] = {&policy_lru, &policy_clock,
+                                           &policy_slru, &policy_s3fifo,
+                                           &policy_arc, &policy_gdsf};
+
+const policy_t *policy_by_name(const char *name) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(policies[i]->name, name) == 0) {
+            return policies[i];
+        }
+    }
+    return NULL;
+}
+
+const char *policy_names(void) {
+    return "lru, clock, slru, s3fifo, arc, gdsf";
+}
@@ -0,0 +1,61 @@
+/*
+ * policy.h - replacement policies behind the cache
+ *
+ * cache.c owns the hash index, the byte accounting and the locking; a policy
+ * only decides the order blocks leave in. Each shard gives its policy two
+ * block lists and two ghost lists of recently evicted key hashes to arrange
+ * as it likes. The policy must keep shard->oldest current: the stamp of the
+ * block it would evict next, which eviction compares across shards to pick
+ * the shard to take a block from.
+ *
+ * Hits on a policy with readOnlyHit set only touch atomics in the block, so
+ * find_key serves them under the shard's read lock; every other callback runs
+ * with the shard's write lock held.
+ */
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct cache_blocks;
+struct cache_shard;
+struct block_elem;
+
+typedef struct policy {
+    const char *name;
+    bool readOnlyHit; // hit() may run concurrently under the read lock
+
+    /*hit: block was found by a lookup*/
+    void (*hit)(struct cache_blocks *cache, struct cache_shard *shard,
+                struct block_elem *block);
+    /*admit: link a new block into the shard's lists*/
+    void (*admit)(struct cache_blocks *cache, struct cache_shard *shard,
+                  struct block_elem *block);
+    /*victim: unlink and return the next block to evict, NULL if empty*/
+    struct block_elem *(*victim)(struct cache_blocks *cache,
+                                 struct cache_shard *shard);
+    /*next: the block victim() would try first, left linked; NULL if empty.
+      Safe under the read lock*/
+    struct block_elem *(*next)(struct cache_shard *shard);
+    /*remove: unlink a block that is leaving for some other reason than
+      eviction, such as going stale*/
+    void (*remove)(struct cache_blocks *cache, struct cache_shard *shard,
+                   struct block_elem *block);
+} policy_t;
+
+extern const policy_t policy_lru;
+extern const policy_t policy_clock;
+extern const policy_t policy_slru;
+extern const policy_t policy_s3fifo;
+extern const policy_t policy_arc;
+extern const policy_t policy_gdsf;
+
+/*policy_by_name: look a policy up by its name, NULL if there is none*/
+const policy_t *policy_by_name(const char *name);
+
+/*policy_names: the selectable names, for usage messages*/
+const char *policy_names(void);
+
+#endif /* POLICY_H */
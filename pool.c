@@ -0,0 +1,118 @@
+/*
+ * pool.c - bounded producer/consumer queue in front of a worker pool
+ */
+#define _GNU_SOURCE
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+/* queued - number of connections sitting in the pipe */
+static size_t queued(pool_t *pool) {
+    int bytes = 0;
+    if (ioctl(pool->fds[0], FIONREAD, &bytes) < 0) {
+        return 0;
+    }
+    return bytes / sizeof(conn_t *);
+}
+
+/*
+ * worker - pop connections forever, running the pool's job on each
+ */
+static void *worker(void *vargp) {
+    pool_t *pool = vargp;
+    conn_t *conn;
+
+    while (1) {
+        // whole pointers only: every write is one atomic pointer
+        ssize_t n = read(pool->fds[0], &conn, sizeof(conn));
+        if (n != sizeof(conn)) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Worker lost its queue\n");
+            return NULL;
+        }
+
+        __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+        pool->job(conn);
+        __atomic_sub_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pool->done, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+pool_t *pool_init(size_t workers, size_t depth, job_fn *job) {
+    pool_t *pool = Malloc(sizeof(pool_t));
+    if (pipe2(pool->fds, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        exit(1);
+    }
+    // Only the submitting end is non-blocking; idle workers sleep in read()
+    fcntl(pool->fds[1], F_SETFL, O_NONBLOCK);
+    // The kernel rounds the pipe up to a power-of-two number of pages
+    fcntl(pool->fds[1], F_SETPIPE_SZ, (int)(depth * sizeof(conn_t *)));
+    int bytes = fcntl(pool->fds[1], F_GETPIPE_SZ);
+    pool->capacity = bytes > 0 ? bytes / sizeof(conn_t *) : depth;
+    pool->maxDepth = 0;
+    pool->workers = 0;
+    pool->busy = 0;
+    pool->done = 0;
+    pool->job = job;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+    for (size_t i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, worker, pool) != 0) {
+            fprintf(stderr, "Could only start %zu of %zu workers\n", i,
+                    workers);
+            break;
+        }
+        pool->workers++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (pool->workers == 0) {
+        fprintf(stderr, "Error starting worker pool\n");
+        exit(1);
+    }
+    return pool;
+}
+
+bool pool_submit(pool_t *pool, conn_t *conn) {
+    // A pointer is under PIPE_BUF, so the write is all or nothing: a full
+    // pipe is the queue's backpressure, passed back to the reactor
+    ssize_t n;
+    while ((n = write(pool->fds[1], &conn, sizeof(conn))) < 0 &&
+           errno == EINTR) {
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    if (n != sizeof(conn)) {
+        perror("pool_submit");
+        conn_close(conn);
+        return true;
+    }
+    size_t depth = queued(pool);
+    if (depth > pool->maxDepth) {
+        pool->maxDepth = depth; // only the reactor writes it
+    }
+    return true;
+}
+
+void pool_stats(pool_t *pool, pool_stats_t *stats) {
+    stats->workers = pool->workers;
+    stats->busy = __atomic_load_n(&pool->busy, __ATOMIC_RELAXED);
+    stats->depth = queued(pool);
+    stats->capacity = pool->capacity;
+    stats->maxDepth = pool->maxDepth;
+    stats->done = __atomic_load_n(&pool->done, __ATOMIC_RELAXED);
+}
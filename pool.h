@@ -0,0 +1,60 @@
+/*
+ * pool.h - fixed pool of worker threads fed by a bounded queue
+ *
+ * The reactor is the only producer: it pushes every connection that has a
+ * complete request head. Workers are spawned once at startup and pop
+ * connections off the queue, so no thread is created on the request path.
+ * When every worker is busy and the queue is full, pool_submit refuses the
+ * connection rather than block the reactor, which holds it in a backlog of
+ * its own and stops accepting until the queue drains, letting the kernel
+ * backlog absorb the burst instead of the host.
+ *
+ * The queue is a pipe carrying conn_t pointers. Pointer-sized writes to a
+ * pipe are atomic, so any number of workers can read from it directly, and
+ * an idle worker sleeps in read() instead of parked on a mutex.
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include "reactor.h"
+#include <pthread.h>
+#include <stddef.h>
+
+#define POOL_DEFAULT_WORKERS 64
+#define POOL_DEFAULT_DEPTH 1024
+#define POOL_STACK_SIZE (512 * 1024)
+
+/* Work run by a worker for each connection it pops */
+typedef void job_fn(conn_t *conn);
+
+typedef struct pool {
+    int fds[2];          // Handoff pipe: fds[1] for the reactor, fds[0] workers
+    size_t capacity;     // Connections the pipe holds before submit refuses
+    size_t maxDepth;     // High-water mark of queued connections
+    size_t workers;      // Number of worker threads
+    size_t busy;         // Workers currently running a job (atomic)
+    unsigned long done;  // Jobs completed since startup (atomic)
+    job_fn *job;         // Run for every popped connection
+} pool_t;
+
+/* Snapshot of the pool counters */
+typedef struct pool_stats {
+    size_t workers;
+    size_t busy;
+    size_t depth;
+    size_t capacity;
+    size_t maxDepth;
+    unsigned long done;
+} pool_stats_t;
+
+/*pool_init: spawn workers threads sharing a queue of depth slots*/
+pool_t *pool_init(size_t workers, size_t depth, job_fn *job);
+
+/*pool_submit: queue a connection; false, without waiting, if the queue is
+  full*/
+bool pool_submit(pool_t *pool, conn_t *conn);
+
+/*pool_stats: copy the current counters out*/
+void pool_stats(pool_t *pool, pool_stats_t *stats);
+
+#endif /* POOL_H */
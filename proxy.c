@@ -1,45 +1,59 @@
+#define _GNU_SOURCE
+#include "compress.h"
 #include "csapp.h"
-#include "http_parser.h"
+#include "disk.h"
+#include "dns.h"
+#include "metrics.h"
+#include "negative.h"
+#include "pool.h"
+#include "reactor.h"
+#include "request.h"
+#include "segment.h"
+#include "snapshot.h"
+#include "upstream.h"
 #include <pthread.h>
 
 #include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 // URI Cache implementation:
 #include "cache.h"
 
-pthread_mutex_t mutex;
 cache_t *cache;
+pool_t *pool;
+
+// Coalesce concurrent misses on one URI into a single origin fetch (-c)
+static bool coalesce = false;
+
+// Where the cache is saved on shutdown and periodically (--cache-file)
+static const char *cacheFile = NULL;
+
+// Seconds a stale response may be served while it is revalidated, when the
+// origin does not say (-r)
+static long staleDefault = 0;
 
 #define HOSTLEN 256
 #define SERVLEN 8
-#define MAX_OBJECT_SIZE (100 * 1024)
-#define MAX_CACHE_SIZE (1024 * 1024)
-
-/*From tiny.c implementation:*/
-/* Typedef for convenience */
-typedef struct sockaddr SA;
-
-/* Information about a connected client. */
-typedef struct {
-    struct sockaddr_in addr; // Socket address
-    socklen_t addrlen;       // Socket address length
-    int connfd;              // Client connection file descriptor
-    char host[HOSTLEN];      // Client host
-    char serv[SERVLEN];      // Client service (port)
-} client_info;
 
 /* URI parsing results. */
 typedef enum { PARSE_ERROR, PARSE_STATIC, PARSE_DYNAMIC } parse_result;
@@ -48,20 +62,41 @@ typedef enum { PARSE_ERROR, PARSE_STATIC, PARSE_DYNAMIC } parse_result;
  * String to use for the User-Agent header.
  * Don't forget to terminate with \r\n
  */
-static const char *header_user_agent = "Mozilla/5.0"
-                                       " (X11; Linux x86_64; rv:3.10.0)"
-                                       " Gecko/20230411 Firefox/63.0.1";
-static const char *header_connection = "Connection close\r\n";
-static const char *header_proxy = "Proxy-Connection: close\r\n";
+#define HEADER_USER_AGENT                                                      \
+    "Mozilla/5.0"                                                              \
+    " (X11; Linux x86_64; rv:3.10.0)"                                          \
+    " Gecko/20230411 Firefox/63.0.1"
+
+/*
+ * Headers the proxy adds to every upstream request, assembled at compile
+ * time so forwarding a request never formats them.
+ */
+static const char header_block[] = "User-Agent: " HEADER_USER_AGENT "\r\n"
+                                   "Connection: close\r\n"
+                                   "Proxy-Connection: close\r\n";
+// Sent instead when the upstream keep-alive pool is on (-k)
+static const char header_block_keepalive[] =
+    "User-Agent: " HEADER_USER_AGENT "\r\n"
+    "Connection: keep-alive\r\n";
+
+/* iovecs in one upstream request: line, Host, block, our own headers, the
+   client's headers, blank line */
+#define REQUEST_IOVS (13 + 2 * REQUEST_MAX_HEADERS)
 
 void print_cache(cache_t *c) {
     sio_printf("*****************PRINTING CACHE********************\n");
-    for (block_t *n = c->head; n != NULL; n = n->next) {
-        sio_printf("ADDRESS: %p\n", n);
-        sio_printf("REF CNT: %ld\n", n->refCount);
-        sio_printf("URL: %s\n", n->key);
+    for (size_t s = 0; s < c->nshards; s++) {
+        for (int l = 0; l < 2; l++) {
+            block_t *n = c->shards[s].lists[l].head;
+            for (; n != NULL; n = n->next) {
+                sio_printf("SHARD: %zu LIST: %d\n", s, l);
+                sio_printf("ADDRESS: %p\n", n);
+                sio_printf("REF CNT: %ld\n", n->refCount);
+                sio_printf("URL: %s\n", n->key);
 
-        sio_printf("******************************************\n");
+                sio_printf("******************************************\n");
+            }
+        }
     }
     sio_printf("************END PRINT****************\n");
 }
@@ -114,271 +149,1302 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
     }
 }
 
-bool read_requesthdrs(int connfd, rio_t *rp, parser_t *parser) {
-    char buf[MAXLINE];
+static void iov_add(struct iovec *iov, int *n, const void *base, size_t len) {
+    iov[*n].iov_base = (void *)base;
+    iov[*n].iov_len = len;
+    (*n)++;
+}
 
-    while (true) {
-        if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
+static void iov_slice(struct iovec *iov, int *n, const request_t *request,
+                      slice_t s) {
+    iov_add(iov, n, request_ptr(request, s), s.len);
+}
+
+#define IOV_LITERAL(iov, n, str) iov_add(iov, n, str, sizeof(str) - 1)
+
+/*
+ * build_request - lay out the request line and headers for the origin server
+ *     as an iovec list, replacing Host/User-Agent/Connection/Proxy-Connection
+ *     with our own. Client text is referenced in place in the request buffer
+ *     and our own headers come from the static header block, so nothing is
+ *     copied or formatted. A non-NULL conditional holds the validator
+ *     headers of a revalidation, and a non-NULL range the Range header of a
+ *     chunk fetch, each sent in place of the client's own. Returns the
+ *     number of iovecs used.
+ */
+int build_request(const request_t *request, const char *host,
+                  const char *port, const char *conditional,
+                  const char *range, struct iovec *iov) {
+    bool keepalive = upstream_keepalive();
+    int n = 0;
+
+    iov_slice(iov, &n, request, request->method);
+    IOV_LITERAL(iov, &n, " ");
+    // An empty path is sent as "/", also when a query follows it directly
+    if (request->path.len == 0 || *request_ptr(request, request->path) != '/') {
+        IOV_LITERAL(iov, &n, "/");
+    }
+    if (request->path.len > 0) {
+        iov_slice(iov, &n, request, request->path);
+    }
+    if (keepalive) {
+        IOV_LITERAL(iov, &n, " HTTP/1.1\r\nHost: ");
+    } else {
+        IOV_LITERAL(iov, &n, " HTTP/1.0\r\nHost: ");
+    }
+
+    const req_header_t *header = request_header(request, "Host");
+    if (header != NULL) {
+        iov_slice(iov, &n, request, header->value);
+        IOV_LITERAL(iov, &n, "\r\n");
+    } else {
+        iov_add(iov, &n, host, strlen(host));
+        IOV_LITERAL(iov, &n, ":");
+        iov_add(iov, &n, port, strlen(port));
+        IOV_LITERAL(iov, &n, "\r\n");
+    }
+
+    if (keepalive) {
+        IOV_LITERAL(iov, &n, header_block_keepalive);
+    } else {
+        IOV_LITERAL(iov, &n, header_block);
+    }
+    if (conditional != NULL) {
+        iov_add(iov, &n, conditional, strlen(conditional));
+    }
+    if (range != NULL) {
+        iov_add(iov, &n, range, strlen(range));
+    }
+
+    // Forwarding headers: each one's name through value is one run of bytes
+    for (size_t i = 0; i < request->nheaders; i++) {
+        header = &request->headers[i];
+        if (request_header_is(request, header, "Host") ||
+            request_header_is(request, header, "User-Agent") ||
+            request_header_is(request, header, "Connection") ||
+            request_header_is(request, header, "Proxy-Connection")) {
+            continue;
+        }
+        if (conditional != NULL &&
+            (request_header_is(request, header, "If-None-Match") ||
+             request_header_is(request, header, "If-Modified-Since"))) {
+            continue;
+        }
+        if (range != NULL &&
+            (request_header_is(request, header, "Range") ||
+             request_header_is(request, header, "If-Range"))) {
+            continue;
+        }
+        slice_t line = {.off = header->name.off,
+                        .len = header->value.off + header->value.len -
+                               header->name.off};
+        iov_slice(iov, &n, request, line);
+        IOV_LITERAL(iov, &n, "\r\n");
+    }
+
+    IOV_LITERAL(iov, &n, "\r\n");
+    return n;
+}
+
+/*
+ * writev_all - write an iovec list in full, resuming after short writes.
+ *     Consumes the list. Returns false on error.
+ */
+static bool writev_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return false;
         }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+/*
+ * capture_buffer - this worker's MAX_OBJECT_SIZE buffer for responses being
+ *     cached, allocated on first use and reused for every fetch after that;
+ *     insert_block copies what it keeps. NULL if memory ran out.
+ */
+static char *capture_buffer(void) {
+    static __thread char *buffer;
+    if (buffer == NULL) {
+        buffer = malloc(MAX_OBJECT_SIZE);
+    }
+    return buffer;
+}
+
+/*
+ * conditional_headers - the If-None-Match and If-Modified-Since lines that
+ *     revalidate block, or an empty string if it has no validator
+ */
+static void conditional_headers(const block_t *block, char *buf, size_t n) {
+    size_t len = 0;
+    buf[0] = '\0';
+    if (block->etag[0] != '\0') {
+        len = snprintf(buf, n, "If-None-Match: %s\r\n", block->etag);
+    }
+    struct tm tm;
+    if (block->lastModified >= 0 && len < n &&
+        gmtime_r(&block->lastModified, &tm) != NULL) {
+        char date[64];
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        snprintf(buf + len, n - len, "If-Modified-Since: %s\r\n", date);
+    }
+}
+
+/*
+ * response_meta - what the cache keeps about the response just read from up.
+ *     It may be served stale for the origin's stale-while-revalidate window,
+ *     or for -r seconds if it gave none, unless it must be revalidated first.
+ */
+static void response_meta(const upstream_t *up, bool keepAlive, uint32_t cost,
+                          block_meta_t *meta) {
+    meta->keepAlive = keepAlive;
+    meta->cost = cost;
+    meta->expires = up->expires;
+    long long window = up->staleRevalidate >= 0 ? up->staleRevalidate
+                                                : staleDefault;
+    if (up->mustRevalidate) {
+        window = 0;
+    }
+    meta->staleWindow = window < UINT32_MAX ? (uint32_t)window : UINT32_MAX;
+    meta->lastModified = up->lastModified;
+    meta->etag = up->etag;
+    meta->plainSize = 0;
+    meta->headLen = 0;
+}
+
+/*
+ * accepts_gzip - true if the client's Accept-Encoding takes gzip, by name or
+ *     through *, with a nonzero quality
+ */
+static bool accepts_gzip(const request_t *request) {
+    const req_header_t *header = request_header(request, "Accept-Encoding");
+    char value[MAXLINE];
+    if (header == NULL ||
+        !request_copy(request, header->value, value, sizeof(value))) {
+        return false;
+    }
+    char *save;
+    for (char *coding = strtok_r(value, ",", &save); coding != NULL;
+         coding = strtok_r(NULL, ",", &save)) {
+        coding += strspn(coding, " \t");
+        size_t len = strcspn(coding, " \t;");
+        if (!(len == 4 && strncasecmp(coding, "gzip", 4) == 0) &&
+            !(len == 6 && strncasecmp(coding, "x-gzip", 6) == 0) &&
+            !(len == 1 && coding[0] == '*')) {
+            continue;
+        }
+        char *q = strstr(coding + len, "q=");
+        return q == NULL || strtod(q + 2, NULL) > 0;
+    }
+    return false;
+}
+
+/*
+ * send_block - write a cached block to the client, its body gzipped or not
+ *     as the client accepts and the block holds it; false if the write fails
+ */
+static bool send_block(int connfd, const block_t *block, bool gzipOk) {
+    if (!compress_send(connfd, block->data, block->blockSize, block->headLen,
+                       block->plainSize, gzipOk)) {
+        return false;
+    }
+    metrics_add(METRIC_BYTES_CACHE, gzipOk || block->plainSize == 0
+                                        ? block->blockSize
+                                        : block->plainSize);
+    return true;
+}
 
-        /* Check for end of request headers */
-        if (strcmp(buf, "\r\n") == 0) {
+/*
+ * fill_segments - start cutting the body of the response just read from up
+ *     into chunks, if it is part of an object too large for the cache: a
+ *     200, or a 206 whose Content-Range says where its bytes sit. head holds
+ *     the headLen bytes of its head. False if it is not kept.
+ */
+static bool fill_segments(const upstream_t *up, const char *uri,
+                          const char *head, size_t headLen,
+                          segment_fill_t *fill) {
+    if (!segment_enabled() || up->noStore || up->state != UP_LENGTH) {
+        return false;
+    }
+    segment_meta_t meta;
+    if (up->status == 200) {
+        meta.length = up->length;
+        meta.offset = 0;
+    } else if (up->status == 206) {
+        meta.length = up->rangeTotal;
+        meta.offset = up->rangeStart;
+    } else {
+        return false;
+    }
+    if (meta.length <= MAX_OBJECT_SIZE) {
+        return false;
+    }
+    meta.keepAlive = up->keepAlive;
+    meta.expires = up->expires;
+    meta.lastModified = up->lastModified;
+    meta.etag = up->etag;
+    return segment_fill_begin(fill, uri, head, headLen, &meta);
+}
+
+/*
+ * open_origin - connect to the origin and send it the request, with the
+ *     validator or Range headers given in place of the client's own. A pooled
+ *     socket the origin closed while it sat idle shows up as an empty
+ *     response; the request is then retried once on a fresh socket. An origin
+ *     that refused the connection or timed out on every address is not tried
+ *     again for a few seconds; lookup failures are dns.c's to remember, and
+ *     local errors such as running out of fds are nobody's. On failure
+ *     the client gets a 502, unless connfd is -1. *sent is set to when the
+ *     request went out, for timing the origin's first byte.
+ */
+static bool open_origin(upstream_t *up, int connfd, const request_t *request,
+                        const char *host, const char *port,
+                        const char *conditional, const char *range,
+                        uint64_t *sent) {
+    for (int attempt = 0;; attempt++) {
+        bool down = negative_down(host, port);
+        uint64_t start = metrics_now();
+        int rc = down ? -1 : upstream_open(up, host, port, attempt > 0);
+        if (rc < 0) {
+            fprintf(stderr, "Could not connect to host: %s\n", host);
+            if (!down && rc == -1) {
+                negative_mark_down(host, port);
+            }
+            if (connfd >= 0) {
+                clienterror(connfd, "502", "Bad Gateway",
+                            "Proxy could not connect to the origin server");
+            }
             return false;
         }
+        metrics_time(PHASE_CONNECT, start);
+        struct iovec iov[REQUEST_IOVS];
+        int niov = build_request(request, host, port, conditional, range, iov);
+        bool written = writev_all(up->fd, iov, niov);
+        *sent = metrics_now();
+        if (written && upstream_responding(up)) {
+            return true;
+        }
+        bool retry = up->reused;
+        upstream_release(up);
+        if (!retry) {
+            fprintf(stderr, "Error writing request\n");
+            return false;
+        }
+    }
+}
+
+/*
+ * fetch_origin - connect to the origin, forward the request and relay the
+ *     response to the client, caching it if it fits. If the client goes away
+ *     the response is still read to the end for the cache, since threads
+ *     waiting on this fetch are counting on it. With a stale block, the
+ *     request is made conditional on its validators: the head is held back
+ *     until the status is known, and on 304 Not Modified the block is made
+ *     fresh again and its body sent instead. Error responses go to the
+ *     negative cache rather than this one, and an origin that cannot be
+ *     reached is not tried again for a few seconds. Partial (206) responses
+ *     are never cached whole; they, and bodies too large for the cache, are
+ *     cut into chunks by the segment store if it is on. A connfd of -1 fetches
+ *     for the cache alone. Returns true if the whole response reached the
+ *     client and its head lets the connection persist.
+ */
+bool fetch_origin(int connfd, const request_t *request, const char *host,
+                  const char *port, const char *uri, block_t *stale) {
+    // The fetch is timed for the cache, which weighs blocks by what they
+    // would cost to fetch again
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *data = capture_buffer();
+    char conditional[UPSTREAM_ETAG_LEN + 128];
+    conditional[0] = '\0';
+    if (stale != NULL && data != NULL) {
+        conditional_headers(stale, conditional, sizeof(conditional));
+    }
+    if (data == NULL || conditional[0] == '\0') {
+        stale = NULL; // nothing to hold the head in, or nothing to ask
+    }
+
+    upstream_t up;
+    uint64_t sent;
+    if (!open_origin(&up, connfd, request, host, port,
+                     stale != NULL ? conditional : NULL, NULL, &sent)) {
+        return false;
+    }
+
+    // The response is read straight into the capture buffer and relayed to
+    // the client from there. Once the object outgrows MAX_OBJECT_SIZE, or its
+    // head rules out caching, capturing stops and the rest of the body is
+    // spliced straight through. With a disk tier, an object that is only too
+    // big for memory is spilled to a file instead, as long as it fits there.
+    ssize_t numBytes;
+    size_t totalBytes = 0;
+    size_t relayed = 0; // bytes of the response the client got
+    bool addFlag = data != NULL;
+    bool clientOk = connfd >= 0;
+    bool holding = stale != NULL; // head held back until its status is read
+    bool notModified = false;
+    char bufTerm[MAXLINE];
+    disk_spill_t spill;
+    bool spilling = false;
+    segment_fill_t fill;
+    bool filling = false;
+
+    while (true) {
+        char *dst = bufTerm;
+        size_t room = MAXLINE;
+        if (addFlag && totalBytes < MAX_OBJECT_SIZE) {
+            dst = data + totalBytes;
+            room = MAX_OBJECT_SIZE - totalBytes;
+            room = room < MAXLINE ? room : MAXLINE;
+        }
+
+        if ((numBytes = upstream_read(&up, dst, room)) <= 0) {
+            break;
+        }
+        if (sent != 0) {
+            metrics_time(PHASE_FIRST_BYTE, sent);
+            sent = 0;
+        }
+        if (holding && (up.state != UP_HEAD || dst == bufTerm)) {
+            holding = false;
+            if (up.state != UP_HEAD && up.status == 304) {
+                notModified = true;
+                break;
+            }
+            if (clientOk && rio_writen(connfd, data, totalBytes) < 0) {
+                clientOk = 0;
+            }
+            relayed += clientOk ? totalBytes : 0;
+        }
+        if (!holding && clientOk && rio_writen(connfd, dst, numBytes) < 0) {
+            clientOk = 0;
+        }
+        relayed += !holding && clientOk ? numBytes : 0;
+
+        bool overflow = dst == bufTerm && addFlag;
+        if (overflow) {
+            addFlag = 0; // a full MAX_OBJECT_SIZE buffer and still more
+        }
+        if (addFlag) {
+            totalBytes += numBytes;
+        }
+        if (filling) {
+            segment_fill_write(&fill, dst, numBytes);
+        }
+        // Once the head says the object cannot be cached, stop capturing.
+        // Everything captured so far is then head, which the segment store
+        // keeps with the chunks of a large or partial body
+        bool tooBig = false;
+        if (addFlag && up.state != UP_HEAD &&
+            (up.noStore || up.status == 206 ||
+             (up.state == UP_LENGTH &&
+              totalBytes + up.remaining > MAX_OBJECT_SIZE))) {
+            tooBig = !up.noStore && up.status != 206;
+            filling = fill_segments(&up, uri, data, totalBytes, &fill);
+            addFlag = 0;
+        }
+        if (spilling) {
+            spilling = disk_spill_write(&spill, dst, numBytes);
+        } else if ((overflow || tooBig) && !filling && disk_enabled() &&
+                   up.status < 400) {
+            size_t expect =
+                up.state == UP_LENGTH ? totalBytes + up.remaining : 0;
+            spilling = disk_spill_begin(&spill, expect) &&
+                       disk_spill_write(&spill, data, totalBytes) &&
+                       (!overflow || disk_spill_write(&spill, dst, numBytes));
+        }
+        if (!clientOk && !addFlag && !spilling && !filling) {
+            break; // nobody left to deliver this to
+        }
+        if (!addFlag && !spilling && !filling && up.state != UP_HEAD) {
+            // Nothing left to capture: splice the rest socket to socket
+            int rc = upstream_relay(&up, connfd);
+            clientOk = rc != -2;
+            numBytes = rc == -1 ? -1 : 0;
+            break;
+        }
+    }
+    if (filling) {
+        segment_fill_end(&fill);
+    }
+    metrics_add(METRIC_BYTES_UPSTREAM, relayed + up.relayed);
+    if (notModified) {
+        block_meta_t meta;
+        response_meta(&up, stale->keepAlive, stale->cost, &meta);
+        cache_refresh(cache, stale, &meta);
+        upstream_release(&up);
+        if (clientOk && !send_block(connfd, stale, accepts_gzip(request))) {
+            clientOk = 0;
+        }
+        return clientOk && stale->keepAlive;
+    }
+    if (numBytes < 0 || up.status == 304) {
+        addFlag = 0; // a 304 answers the client's own conditional request
+    }
+    bool keepAlive = numBytes == 0 && up.state == UP_DONE && up.keepAlive;
+    if (spilling) {
+        if (numBytes == 0) {
+            disk_spill_commit(&spill, uri, keepAlive, up.expires);
+        } else {
+            disk_spill_abort(&spill);
+        }
+    }
+    if (addFlag && totalBytes > 0) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long long micros = (end.tv_sec - start.tv_sec) * 1000000LL +
+                           (end.tv_nsec - start.tv_nsec) / 1000;
+        uint32_t cost = micros < UINT32_MAX ? (uint32_t)micros : UINT32_MAX;
+
+        if (up.status >= 400) {
+            bool explicit =
+                up.sMaxAge >= 0 || up.maxAge >= 0 || up.expiresAt >= 0;
+            if (negative_cacheable(up.status, explicit)) {
+                negative_store(uri, data, totalBytes, keepAlive, up.expires);
+            }
+        } else {
+            // Text bodies may be kept gzipped, charged at their packed size
+            block_meta_t meta;
+            response_meta(&up, keepAlive, cost, &meta);
+            const char *packed;
+            size_t size = compress_enabled()
+                              ? compress_response(data, totalBytes, &packed,
+                                                  &meta.headLen)
+                              : 0;
+            if (size > 0) {
+                meta.plainSize = totalBytes;
+                insert_block(cache, size, uri, packed, &meta);
+            } else {
+                insert_block(cache, totalBytes, uri, data, &meta);
+            }
+        }
+    }
+
+    upstream_release(&up);
+    return clientOk && keepAlive;
+}
+
+/*
+ * client_keepalive - returns true if the client asked to keep its connection
+ *     open: HTTP/1.1 unless it says close, HTTP/1.0 only if it says keep-alive
+ */
+bool client_keepalive(const request_t *request) {
+    bool persist = !request_is(request, request->version, "1.0");
+
+    const req_header_t *header = request_header(request, "Connection");
+    if (header == NULL) {
+        header = request_header(request, "Proxy-Connection");
+    }
+    if (header != NULL) {
+        if (request_contains(request, header->value, "close")) {
+            persist = false;
+        } else if (request_contains(request, header->value, "keep-alive")) {
+            persist = true;
+        }
+    }
+    return persist;
+}
+
+/*
+ * serve_snapshot - answer uri from the snapshot loaded at startup, if it has
+ *     it, and move the response into the cache. A gzipped body is sent as it
+ *     is only if gzipOk. Clears *persist like serve_disk. Returns false if
+ *     the snapshot cannot answer; a stale copy it has is still moved into
+ *     the cache, for find_stale to hand out.
+ */
+bool serve_snapshot(int connfd, const char *uri, bool gzipOk, bool *persist) {
+    const char *data;
+    size_t size;
+    block_meta_t meta;
+    bool stale;
+    if (!snapshot_take(uri, &data, &size, &meta, &stale)) {
+        return false;
+    }
+    if (stale) {
+        insert_block(cache, size, uri, data, &meta);
+        return false;
+    }
+    if (!compress_send(connfd, data, size, meta.headLen, meta.plainSize,
+                       gzipOk)) {
+        fprintf(stderr, "Error: client response\n");
+        *persist = false;
+    } else {
+        metrics_add(METRIC_BYTES_CACHE,
+                    gzipOk || meta.plainSize == 0 ? size : meta.plainSize);
+    }
+    metrics_add(METRIC_HITS, 1);
+    *persist = *persist && meta.keepAlive;
+    insert_block(cache, size, uri, data, &meta);
+    return true;
+}
+
+/*
+ * serve_disk - send uri from the disk tier with sendfile, if it is there.
+ *     Clears *persist if the client write fails or the cached head does not
+ *     let the connection persist. Returns false on a disk miss.
+ */
+bool serve_disk(int connfd, const char *uri, bool *persist) {
+    size_t size;
+    bool keepAlive;
+    int fd = disk_open(uri, &size, &keepAlive);
+    if (fd < 0) {
+        return false;
+    }
+    off_t off = 0;
+    while ((size_t)off < size) {
+        ssize_t n = sendfile(connfd, fd, &off, size - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "Error: client response\n");
+            *persist = false;
+            break;
+        }
+    }
+    close(fd);
+    metrics_add(METRIC_HITS, 1);
+    metrics_add(METRIC_BYTES_CACHE, off);
+    *persist = *persist && keepAlive;
+    return true;
+}
+
+/*
+ * client_range - the bytes [*first, *last] a Range request asks for out of
+ *     an object of length bytes. Only a single bytes range is honoured, and
+ *     not one made conditional by If-Range; false means the whole object is
+ *     sent instead, as a server may always do.
+ */
+static bool client_range(const request_t *request, long long length,
+                         long long *first, long long *last) {
+    const req_header_t *header = request_header(request, "Range");
+    char value[MAXLINE];
+    if (header == NULL || request_header(request, "If-Range") != NULL ||
+        !request_copy(request, header->value, value, sizeof(value)) ||
+        strncasecmp(value, "bytes=", 6) != 0 ||
+        strchr(value, ',') != NULL) {
+        return false;
+    }
 
-        /* Parse header into name and value */
-        parser_state ps = parser_parse_line(parser, buf);
-        if (ps != HEADER) {
-            /* Error parsing header */
-            clienterror(connfd, "400", "Bad Request",
-                        "Tiny could not parse request headers");
+    char *p = value + 6;
+    char *end;
+    if (*p == '-') {
+        long long suffix = strtoll(p + 1, &end, 10);
+        if (end == p + 1 || *end != '\0' || suffix <= 0) {
             return false;
         }
+        *first = suffix < length ? length - suffix : 0;
+        *last = length - 1;
+        return true;
     }
-    return false;
+    *first = strtoll(p, &end, 10);
+    if (end == p || *end != '-' || *first < 0 || *first >= length) {
+        return false;
+    }
+    p = end + 1;
+    if (*p == '\0') {
+        *last = length - 1;
+        return true;
+    }
+    *last = strtoll(p, &end, 10);
+    if (*end != '\0' || *last < *first) {
+        return false;
+    }
+    if (*last >= length) {
+        *last = length - 1;
+    }
+    return true;
 }
 
-// void serve(client_info *client) {
-void serve(int connfd) {
+/*
+ * fetch_run - fetch chunks [i, j] of a segmented object from the origin with
+ *     a Range request of our own, store them, and send the client the part
+ *     of them inside [first, last]. The response head has already been
+ *     sent, so any failure, including the origin answering with another
+ *     version of the object, leaves the client with a short body. Returns
+ *     false then.
+ */
+static bool fetch_run(int connfd, const request_t *request, const char *host,
+                      const char *port, const char *uri,
+                      const segment_info_t *info, size_t i, size_t j,
+                      long long first, long long last) {
+    long long from = (long long)i * SEGMENT_CHUNK;
+    long long to = (long long)(j + 1) * SEGMENT_CHUNK;
+    to = (to < info->length ? to : info->length) - 1;
+    char range[64];
+    snprintf(range, sizeof(range), "Range: bytes=%lld-%lld\r\n", from, to);
+
+    upstream_t up;
+    uint64_t sent;
+    if (!open_origin(&up, -1, request, host, port, NULL, range, &sent)) {
+        return false;
+    }
+    char *head = capture_buffer();
+    size_t headLen = 0;
+    ssize_t numBytes = 0;
+    while (head != NULL && up.state == UP_HEAD &&
+           headLen + MAXLINE <= MAX_OBJECT_SIZE &&
+           (numBytes = upstream_read(&up, head + headLen, MAXLINE)) > 0) {
+        if (headLen == 0) {
+            metrics_time(PHASE_FIRST_BYTE, sent);
+        }
+        headLen += numBytes;
+    }
+
+    // An origin that ignores Range sends the whole object, which does too
+    segment_fill_t fill;
+    bool filling =
+        head != NULL && fill_segments(&up, uri, head, headLen, &fill);
+    bool ok = filling && fill.id == info->id && fill.pos <= from;
 
-    rio_t rio;
-    parser_t *parser;
     char buf[MAXLINE];
+    long long pos = ok ? fill.pos : 0;
+    while (ok && pos <= to) {
+        if ((numBytes = upstream_read(&up, buf, sizeof(buf))) <= 0) {
+            ok = false;
+            break;
+        }
+        segment_fill_write(&fill, buf, numBytes);
+        long long lo = pos > from ? pos : from;
+        lo = lo > first ? lo : first;
+        long long hi = pos + numBytes - 1;
+        hi = hi < to ? hi : to;
+        hi = hi < last ? hi : last;
+        if (lo <= hi) {
+            ok = rio_writen(connfd, buf + (lo - pos), hi - lo + 1) >= 0;
+            metrics_add(METRIC_BYTES_UPSTREAM, ok ? hi - lo + 1 : 0);
+        }
+        pos += numBytes;
+    }
+    if (filling) {
+        segment_fill_end(&fill);
+    }
+    upstream_release(&up);
+    return ok;
+}
+
+/*
+ * serve_segments - answer uri from the segment store if it knows the object:
+ *     the whole of it, or the range the client asked for. Chunks present are
+ *     sent from memory; each run of missing ones is fetched with one Range
+ *     request, which makes the request a miss. Clears *persist like
+ *     serve_disk, and if a run could not be fetched. Returns false if the
+ *     store does not know the object.
+ */
+bool serve_segments(int connfd, const request_t *request, const char *host,
+                    const char *port, const char *uri, bool *persist) {
+    segment_info_t info;
+    if (!segment_open(uri, &info)) {
+        return false;
+    }
+    long long first = 0;
+    long long last = info.length - 1;
+    bool partial = client_range(request, info.length, &first, &last);
+    char head[SEGMENT_HEAD_LEN];
+    size_t headLen =
+        segment_head(&info, partial, first, last, head, sizeof(head));
+    bool ok = rio_writen(connfd, head, headLen) >= 0;
+    metrics_add(METRIC_BYTES_CACHE, ok ? headLen : 0);
 
-    rio_readinitb(&rio, connfd);
+    bool fetched = false;
+    size_t end = last / SEGMENT_CHUNK;
+    for (size_t i = first / SEGMENT_CHUNK; ok && i <= end;) {
+        segment_chunk_t *chunk = segment_get(uri, info.id, i);
+        if (chunk != NULL) {
+            long long start = (long long)i * SEGMENT_CHUNK;
+            long long lo = first > start ? first : start;
+            long long hi = start + (long long)chunk->size - 1;
+            hi = hi < last ? hi : last;
+            ok = rio_writen(connfd, chunk->data + (lo - start),
+                            hi - lo + 1) >= 0;
+            metrics_add(METRIC_BYTES_CACHE, ok ? hi - lo + 1 : 0);
+            segment_release(chunk);
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j < end && !segment_has(uri, info.id, j + 1)) {
+            j++;
+        }
+        ok = fetch_run(connfd, request, host, port, uri, &info, i, j, first,
+                       last);
+        fetched = true;
+        i = j + 1;
+    }
+    metrics_add(fetched ? METRIC_MISSES : METRIC_HITS, 1);
+    if (!ok) {
+        fprintf(stderr, "Error: client response\n");
+        *persist = false;
+    }
+    *persist = *persist && info.keepAlive;
+    return true;
+}
 
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
+/*
+ * copy_target - copy the request's host, port and URI out of its buffer;
+ *     false if one does not fit
+ */
+static bool copy_target(const request_t *request, char *host, char *port,
+                        char *uri) {
+    bool fits = request_copy(request, request->host, host, HOSTLEN) &&
+                request_copy(request, request->uri, uri, MAXLINE);
+    if (request->port.len == 0) {
+        strcpy(port, REQUEST_DEFAULT_PORT);
+    } else {
+        fits = fits && request_copy(request, request->port, port, SERVLEN);
+    }
+    return fits;
+}
+
+/*
+ * A stale block this worker served and claimed for revalidation, refreshed
+ * by run_refresh once the client has its answer. The client's request is gone
+ * by then, so the refresh is a plain GET of the URI.
+ */
+static __thread struct {
+    block_t *block; // pinned and claimed, NULL if nothing is pending
+    char head[MAXLINE + 32];
+} pending;
+
+/*
+ * schedule_refresh - revalidate block after this request if nothing else is
+ *     pending and no other thread is revalidating it already
+ */
+static void schedule_refresh(block_t *block, const char *uri) {
+    if (pending.block != NULL || !refresh_claim(block)) {
+        release_block(block);
+        return;
+    }
+    snprintf(pending.head, sizeof(pending.head), "GET %s HTTP/1.0\r\n\r\n",
+             uri);
+    pending.block = block;
+}
+
+/*
+ * run_refresh - revalidate the block schedule_refresh left pending, if any
+ */
+static void run_refresh(void) {
+    block_t *block = pending.block;
+    if (block == NULL) {
         return;
     }
+    pending.block = NULL;
+
+    request_t request;
+    char host[HOSTLEN];
+    char port[SERVLEN];
+    char uri[MAXLINE];
+    request_init(&request);
+    if (request_parse(&request, pending.head, strlen(pending.head)) ==
+            REQ_COMPLETE &&
+        copy_target(&request, host, port, uri)) {
+        fetch_origin(-1, &request, host, port, uri, block);
+    }
+    refresh_done(block);
+    release_block(block);
+}
+
+/*
+ * stats_request - true if the request is for the proxy's stats page rather
+ *     than one to forward: an origin-form METRICS_PATH. *json is set if its
+ *     query asks for format=json.
+ */
+static bool stats_request(const request_t *request, bool *json) {
+    char path[MAXLINE];
+    size_t len = strlen(METRICS_PATH);
+    if (request->host.len != 0 ||
+        !request_copy(request, request->path, path, sizeof(path)) ||
+        strncmp(path, METRICS_PATH, len) != 0 ||
+        (path[len] != '\0' && path[len] != '?')) {
+        return false;
+    }
+    *json = path[len] == '?' && strstr(path + len, "format=json") != NULL;
+    return true;
+}
+
+/*
+ * serve_metrics - send the stats page, as text or JSON. It is never cached,
+ *     and the connection is closed after it, so returns false.
+ */
+static bool serve_metrics(int connfd, bool json) {
+    char body[MAXBUF];
+    cache_stats_t cs;
+    cache_stats(cache, &cs);
+    size_t bodyLen = metrics_report(body, sizeof(body), json, &cs);
+    char head[MAXLINE];
+    size_t headLen = snprintf(head, sizeof(head),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: %s\r\n"
+                              "Cache-Control: no-store\r\n"
+                              "Connection: close\r\n"
+                              "Content-Length: %zu\r\n\r\n",
+                              json ? "application/json" : "text/plain",
+                              bodyLen);
+    if (rio_writen(connfd, head, headLen) < 0 ||
+        rio_writen(connfd, body, bodyLen) < 0) {
+        fprintf(stderr, "Error: client response\n");
+    }
+    return false;
+}
+
+/*
+ * serve_request - handle one request whose head the reactor has already
+ *     buffered in conn->rio: parse it, connect to the origin and relay the
+ *     response. Returns true if the connection can carry another request.
+ */
+static bool serve_request(conn_t *conn) {
+    int connfd = conn->fd;
+    rio_t *rio = &conn->rio;
+    request_t request;
 
-    parser = parser_new(); // remember to free
-    parser_state pState = parser_parse_line(parser, buf);
+    // The whole head is already buffered; parse it in place
+    uint64_t parseStart = metrics_now();
+    request_init(&request);
+    req_state rState = request_parse(&request, rio->rio_bufptr, rio->rio_cnt);
 
-    if (pState != REQUEST) {
-        parser_free(parser);
+    if (rState == REQ_INCOMPLETE) {
+        clienterror(connfd, "431", "Request Header Fields Too Large",
+                    "Request head does not fit in the proxy's buffer");
+        return false;
+    }
+    if (rState == REQ_ERROR) {
         clienterror(connfd, "400", "Bad Request",
                     "Server received malformed request");
-        return;
+        return false;
     }
+    // Consume the head; the slices stay valid until the buffer is refilled
+    rio->rio_bufptr += request.headLen;
+    rio->rio_cnt -= request.headLen;
 
-    const char *host;
-    const char *port;
-    const char *path;
-    const char *method;
-    const char *uri;
-    parser_retrieve(parser, HOST, &host);
-    parser_retrieve(parser, PORT, &port);
-    parser_retrieve(parser, PATH, &path);
-    parser_retrieve(parser, METHOD, &method);
-    parser_retrieve(parser, URI, &uri);
+    char host[HOSTLEN];
+    char port[SERVLEN];
+    char uri[MAXLINE];
+    if (!copy_target(&request, host, port, uri)) {
+        clienterror(connfd, "400", "Bad Request",
+                    "Server received malformed request");
+        return false;
+    }
+    metrics_time(PHASE_PARSE, parseStart);
 
     // Error's from Tiny.c(serve)
 
-    if (strcmp("GET", method) != 0) {
-        parser_free(parser);
+    if (!request_is(&request, request.method, "GET")) {
         clienterror(connfd, "501", "Not Implemented",
                     "Proxy does not implmement this method");
-        return;
+        return false;
+    }
+    bool json;
+    if (stats_request(&request, &json)) {
+        return serve_metrics(connfd, json);
+    }
+    if (request.host.len == 0) {
+        clienterror(connfd, "400", "Bad Request",
+                    "Proxy requests must give an absolute URI");
+        return false;
     }
+    bool persist = client_keepalive(&request);
+    bool gzipOk = accepts_gzip(&request);
 
-    if (read_requesthdrs(connfd, &rio, parser)) {
-        parser_free(parser);
-        return;
+    // Cache implementation: the block comes back pinned, so it stays valid
+    // while we write it out with no lock held, even if it is evicted.
+    // With -c, concurrent misses on one URI wait here for the first fetch
+    bool leader = false;
+    block_t *block = coalesce ? find_key_or_wait(uri, cache, &leader)
+                              : find_key(uri, cache);
+    if (block != NULL) {
+        metrics_add(METRIC_HITS, 1);
+        if (!send_block(connfd, block, gzipOk)) {
+            fprintf(stderr, "Error: client response\n");
+            persist = false;
+        }
+        persist = persist && block->keepAlive;
+        release_block(block);
+        return persist;
     }
 
-    // Cache implementation:
-    // char *line = malloc(strlen(uri) + 1);
-    // memcpy(line, uri, strlen(uri) + 1);
-
-    // pthread_mutex_lock(&mutex);
-    // block_t *block = find_key(line, cache);
-    // pthread_mutex_unlock(&mutex);
-
-    // if(block != NULL){
-    //     sio_printf("Found!\n");
-    //     pthread_mutex_lock(&mutex);
-    //     block->refCount += 1;
-    //     pthread_mutex_unlock(&mutex);
-
-    //     if (rio_writen(connfd, block->data, block->blockSize) < 0){
-    //         fprintf(stderr, "Error: client response");
-    //         return;
-    //     }
-
-    //     pthread_mutex_lock(&mutex);
-    //     block->refCount --;
-    //     if ((block->refCount == 0) && !find_key(block->key, cache)){
-    //         free(block->data);
-    //         free(block->key);
-    //         free(block);
-    //         pthread_mutex_unlock(&mutex);
-    //         parser_free(parser);
-
-    //     }
-    //     pthread_mutex_unlock(&mutex);
-
-    //     pthread_mutex_lock(&mutex);
-    //     update_LRU(cache, block);
-    //     pthread_mutex_unlock(&mutex);
-
-    //     parser_free(parser);
-    //     return;
-    // }
-    // sio_printf("NOT FOUND! \n");
-
-    int client_fd = open_clientfd(host, port);
-    if (client_fd < 0) {
-        fprintf(stderr, "Could not connect to host: %s\n", host);
-        parser_free(parser);
-        close(client_fd);
-        return;
+    // An error the origin gave for this URI a moment ago is given again
+    char errorPage[NEGATIVE_MAX_OBJECT];
+    size_t errorSize;
+    bool errorKeepAlive;
+    if (negative_find(uri, errorPage, &errorSize, &errorKeepAlive)) {
+        metrics_add(METRIC_HITS, 1);
+        if (rio_writen(connfd, errorPage, errorSize) < 0) {
+            fprintf(stderr, "Error: client response\n");
+            persist = false;
+        } else {
+            metrics_add(METRIC_BYTES_CACHE, errorSize);
+        }
+        if (leader) {
+            finish_flight(uri, cache);
+        }
+        return persist && errorKeepAlive;
     }
 
-    // char bufHeader[MAXLINE];
-    // char *version = "HTTP/1.0\r\n";
-    // size_t size = snprintf(bufHeader, MAXLINE, "%s %s %s", method, path,
-    // version);
-
-    // if (rio_writen(client_fd, bufHeader, size) < 0){
-    //     fprintf(stderr, "Error writing response headers\n");
-    //     return;
-    // }
-
-    // header_t *header = parser_lookup_header(parser, "Host");
-    // if (header != NULL) {
-    //     host = header->value;
-    //     size =
-    //         snprintf(bufHeader, MAXLINE,
-    //                 "Host: %s\r\n"
-    //                 "User-Agent: %s\r\n"
-    //                 "%s"
-    //                 "%s",
-    //                 host, header_user_agent, header_connection,
-    //                 header_proxy);
-    // } else {
-    //     size = snprintf(bufHeader, MAXLINE,
-    //                     "Host: %s:%s\r\n"
-    //                     "User-Agent: %s\r\n"
-    //                     "%s"
-    //                     "%s",
-    //                     host, port, header_user_agent, header_connection,
-    //                     header_proxy);
-    // }
-
-    // if (rio_writen(client_fd, bufHeader, size) < 0) {
-    //     fprintf(stderr, "Error writing response headers\n");
-    //     return;
-    // }
-    // //Forwarding headers
-    // header = parser_retrieve_next_header(parser);
-    // while (header != NULL) {
-    //     if ((strcmp(header->name, "Host") != 0) &&
-    //         (strcmp(header->name, "User-Agent") != 0) &&
-    //         (strcmp(header->name, "Connection") != 0) &&
-    //         (strcmp(header->name, "Proxy-Connection") != 0)){
-    //         size = snprintf(bufHeader, MAXLINE, "%s: %s\r\n", header->name,
-    //         header->value);
-
-    //         if (rio_writen(client_fd, bufHeader, size) < 0){
-    //             fprintf(stderr, "Error writing response headers\n");
-    //             return;
-    //         }
-    //     }
-    //     header = parser_retrieve_next_header(parser);
-
-    // }
-
-    // snprintf(bufHeader, MAXLINE, "\r\n");
-
-    if (rio_writen(client_fd, "\r\n", MAXLINE) < 0) {
-        fprintf(stderr, "Error writing response headers\n");
-        return;
+    // The snapshot from the last run answers next, or leaves a stale copy
+    // of its own in the cache
+    if (serve_snapshot(connfd, uri, gzipOk, &persist)) {
+        if (leader) {
+            finish_flight(uri, cache);
+        }
+        return persist;
     }
 
-    rio_t ser;
-    rio_readinitb(&ser, client_fd);
+    // A stale copy inside its stale-while-revalidate window is sent as is
+    // and revalidated once the client has it; one past it can still save
+    // the origin resending the body if it has not changed
+    bool usable;
+    block_t *stale = find_stale(uri, cache, &usable);
+    if (stale != NULL && usable) {
+        metrics_add(METRIC_HITS, 1);
+        if (!send_block(connfd, stale, gzipOk)) {
+            fprintf(stderr, "Error: client response\n");
+            persist = false;
+        }
+        persist = persist && stale->keepAlive;
+        schedule_refresh(stale, uri);
+        if (leader) {
+            finish_flight(uri, cache);
+        }
+        return persist;
+    }
 
-    // server termination
-    size_t numBytes;
-    // size_t totalBytes = 0;
-    // bool addFlag = 1;
-    char bufTerm[MAXLINE];
-    // char rBuf[MAX_OBJECT_SIZE];
+    // Below memory: chunks of large objects, then the disk tier
+    if ((segment_enabled() &&
+         serve_segments(connfd, &request, host, port, uri, &persist)) ||
+        (disk_enabled() && serve_disk(connfd, uri, &persist))) {
+        if (stale != NULL) {
+            release_block(stale);
+        }
+        if (leader) {
+            finish_flight(uri, cache);
+        }
+        return persist;
+    }
 
-    while ((numBytes = rio_readnb(&ser, bufTerm, MAXLINE)) != 0) {
-        rio_writen(connfd, bufTerm, numBytes);
+    metrics_add(METRIC_MISSES, 1);
+    persist = fetch_origin(connfd, &request, host, port, uri, stale) &&
+              persist;
+    if (stale != NULL) {
+        release_block(stale);
+    }
+    if (leader) {
+        finish_flight(uri, cache);
+    }
+
+    // print_cache(cache);
+
+    return persist;
+}
+
+/*
+ * serve - serve_request, counted and timed for the stats page
+ */
+bool serve(conn_t *conn) {
+    uint64_t start = metrics_now();
+    bool persist = serve_request(conn);
+    metrics_add(METRIC_REQUESTS, 1);
+    metrics_time(PHASE_TOTAL, start);
+    return persist;
+}
 
-        // if (totalBytes + numBytes <= MAX_OBJECT_SIZE) {
-        //     totalBytes += numBytes;
-        //     memcpy(rBuf + totalBytes - numBytes, bufTerm, numBytes);
-        // } else{
-        //     addFlag = 0;
-        // }
+/*
+ * handle_conn - pool job: runs the connect and relay phases for one
+ *     dispatched connection. Pipelined requests already buffered behind it
+ *     are answered here in order; a persistent connection with nothing left
+ *     to answer goes back to the reactor to wait for the next request. A
+ *     stale response served along the way is revalidated after that.
+ */
+void handle_conn(conn_t *conn) {
+    while (serve(conn)) {
+        if (!conn_buffered_request(conn)) {
+            reactor_resume(conn);
+            run_refresh();
+            return;
+        }
     }
-    // if (addFlag) {
-    //     pthread_mutex_lock(&mutex);
-    //     char *data = malloc(totalBytes);
-    //     memcpy(data, rBuf, totalBytes);
-    //     char *key = malloc(strlen(uri) + 1);
-    //     memcpy(key, uri, strlen(uri) + 1);
+    conn_close(conn);
+    run_refresh();
+}
+
+/*
+ * dispatch - called by the reactor once a connection has a full request head.
+ *     Only connections with a request in hand reach the worker pool; idle and
+ *     slow clients stay parked in epoll. False if the pool's queue is full.
+ */
+bool dispatch(conn_t *conn) {
+    return pool_submit(pool, conn);
+}
 
-    //     insert_block(cache, totalBytes, key, data);
-    //     pthread_mutex_unlock(&mutex);
-    // }
+/*
+ * stats_thread - prints the worker pool, DNS, cache, compression, disk
+ *     tier, segment store, negative cache and slab counters whenever the
+ *     proxy receives SIGUSR1. The signal is blocked everywhere else, so the
+ *     counters are read from a normal thread rather than from a signal
+ *     handler. With --cache-file, SIGTERM and SIGINT come here too, and save
+ *     the cache before the proxy exits.
+ */
+void *stats_thread(void *vargp) {
+    sigset_t *mask = vargp;
+    int sig;
 
-    // print_cache(cache);
+    while (sigwait(mask, &sig) == 0) {
+        if (sig != SIGUSR1) {
+            if (!snapshot_save(cache, cacheFile)) {
+                fprintf(stderr, "Could not save the cache to %s\n",
+                        cacheFile);
+            }
+            exit(0);
+        }
+
+        pool_stats_t ps;
+        pool_stats(pool, &ps);
+        fprintf(stderr,
+                "pool: workers %zu busy %zu queued %zu/%zu "
+                "(max %zu) done %lu\n",
+                ps.workers, ps.busy, ps.depth, ps.capacity, ps.maxDepth,
+                ps.done);
+
+        dns_stats_t ds;
+        dns_stats(&ds);
+        fprintf(stderr,
+                "dns: hosts %zu hits %lu negative hits %lu misses %lu "
+                "failures %lu\n",
+                ds.entries, ds.hits, ds.negHits, ds.misses, ds.failures);
+
+        cache_stats_t cs;
+        cache_stats(cache, &cs);
+        unsigned long lookups = cs.hits + cs.misses;
+        fprintf(stderr,
+                "cache: policy %s size %zu hits %lu misses %lu (%.1f%% hit) "
+                "inserts %lu evictions %lu rejected %lu expired %lu "
+                "stale %lu revalidated %lu lookups/s %.1f\n",
+                cs.policy, cs.size, cs.hits, cs.misses,
+                lookups ? 100.0 * cs.hits / lookups : 0.0, cs.inserts,
+                cs.evictions, cs.rejections, cs.expirations, cs.staleHits,
+                cs.revalidations,
+                cs.seconds > 0 ? lookups / cs.seconds : 0.0);
+
+        if (disk_enabled()) {
+            disk_stats_t ks;
+            disk_stats(&ks);
+            fprintf(stderr,
+                    "disk: files %zu bytes %zu/%zu hits %lu misses %lu "
+                    "stores %lu evictions %lu expired %lu failures %lu\n",
+                    ks.entries, ks.bytes, ks.budget, ks.hits, ks.misses,
+                    ks.stores, ks.evictions, ks.expirations, ks.failures);
+        }
+
+        if (segment_enabled()) {
+            segment_stats_t ts;
+            segment_stats(&ts);
+            fprintf(stderr,
+                    "segments: objects %zu chunks %zu bytes %zu/%zu "
+                    "hits %lu misses %lu fills %lu evictions %lu "
+                    "expired %lu\n",
+                    ts.objects, ts.chunks, ts.bytes, ts.budget, ts.hits,
+                    ts.misses, ts.fills, ts.evictions, ts.expirations);
+        }
+
+        if (compress_enabled()) {
+            compress_stats_t zs;
+            compress_stats(&zs);
+            fprintf(stderr,
+                    "compress: stored %lu bytes %zu -> %zu (%.1f%%) "
+                    "sent gzipped %lu inflated %lu\n",
+                    zs.stored, zs.plainBytes, zs.packedBytes,
+                    zs.plainBytes ? 100.0 * zs.packedBytes / zs.plainBytes
+                                  : 0.0,
+                    zs.direct, zs.inflated);
+        }
+
+        negative_stats_t gs;
+        negative_stats(&gs);
+        fprintf(stderr,
+                "negative: entries %zu bytes %zu/%d hits %lu down hits %lu "
+                "stores %lu evictions %lu\n",
+                gs.entries, gs.bytes, NEGATIVE_BUDGET, gs.hits, gs.downHits,
+                gs.stores, gs.evictions);
+
+        slab_stats_t ss;
+        slab_stats(&ss);
+        fprintf(stderr,
+                "slab: arena %zu%s pages %zu/%zu chunk bytes %zu "
+                "allocs %lu overflow %zu\n",
+                ss.arenaBytes, ss.hugePages ? " (huge pages)" : "",
+                ss.pagesUsed, ss.pages, ss.chunkBytes, ss.allocs, ss.overflow);
+
+        if (cacheFile != NULL) {
+            snapshot_stats_t ns;
+            snapshot_stats(&ns);
+            fprintf(stderr,
+                    "snapshot: loaded %zu taken %lu corrupt %lu saves %lu "
+                    "last %zu bytes\n",
+                    ns.loaded, ns.taken, ns.corrupt, ns.saves, ns.lastSize);
+        }
+    }
+    return NULL;
+}
 
-    // parser_free(parser);
-    close(client_fd);
+/*
+ * snapshot_thread - saves the cache to --cache-file every SNAPSHOT_INTERVAL
+ *     seconds, so a crash loses at most that much warmth
+ */
+void *snapshot_thread(void *vargp) {
+    (void)vargp;
+    while (true) {
+        sleep(SNAPSHOT_INTERVAL);
+        if (!snapshot_save(cache, cacheFile)) {
+            fprintf(stderr, "Could not save the cache to %s\n", cacheFile);
+        }
+    }
+    return NULL;
 }
 
-void *thread(void *vargp) {
-    fprintf(stderr, "IN THREAD! \n");
-    int connfd = *((int *)vargp);
-    pthread_detach(pthread_self());
-    Free(vargp);
-    serve(connfd);
-    close(connfd);
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-a] [-c] [-e policy] [-k] [-r stale seconds] "
+            "[-w workers] [-q queue depth] [-s cache shards] [-d disk dir] "
+            "[-b disk MiB] [-g segment MiB] [-z] [--cache-file file] <port>\n"
+            "policies: %s\n",
+            prog, policy_names());
+    exit(1);
 }
 
 int main(int argc, char **argv) {
     int listenfd;
+    long workers = POOL_DEFAULT_WORKERS;
+    long depth = POOL_DEFAULT_DEPTH;
+    long shards = DEFAULT_SHARDS;
+    const policy_t *policy = &policy_lru;
+    bool keepalive = false;
+    bool admission = false;
+    const char *diskDir = NULL;
+    long diskMiB = DISK_DEFAULT_BUDGET / (1024 * 1024);
+    long segmentMiB = 0;
+    int opt;
+    static const struct option longOpts[] = {
+        {"cache-file", required_argument, NULL, 'f'}, {NULL, 0, NULL, 0}};
 
-    // cache = init_cache();
-    // pthread_mutex_init(&mutex, NULL);
     signal(SIGPIPE, SIG_IGN);
 
-    /*From Tiny.c*/
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt_long(argc, argv, "ab:cd:e:f:g:kr:w:q:s:z", longOpts,
+                              NULL)) != -1) {
+        switch (opt) {
+        case 'a':
+            admission = true;
+            break;
+        case 'b':
+            diskMiB = strtol(optarg, NULL, 10);
+            break;
+        case 'c':
+            coalesce = true;
+            break;
+        case 'd':
+            diskDir = optarg;
+            break;
+        case 'f':
+            cacheFile = optarg;
+            break;
+        case 'e':
+            policy = policy_by_name(optarg);
+            if (policy == NULL) {
+                usage(argv[0]);
+            }
+            break;
+        case 'g':
+            segmentMiB = strtol(optarg, NULL, 10);
+            break;
+        case 'k':
+            keepalive = true;
+            break;
+        case 'r':
+            staleDefault = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            workers = strtol(optarg, NULL, 10);
+            break;
+        case 'q':
+            depth = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            shards = strtol(optarg, NULL, 10);
+            break;
+        case 'z':
+            compress_init();
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || workers <= 0 || depth <= 0 ||
+        shards <= 0 || diskMiB <= 0 || staleDefault < 0 ||
+        segmentMiB < 0) {
+        usage(argv[0]);
+    }
+    if (segmentMiB > 0) {
+        segment_init((size_t)segmentMiB * 1024 * 1024);
+    }
+    if (diskDir != NULL &&
+        !disk_init(diskDir, (size_t)diskMiB * 1024 * 1024)) {
+        fprintf(stderr, "Cannot use disk cache directory: %s\n", diskDir);
         exit(1);
     }
+
     // Open listening file descriptor
-    listenfd = open_listenfd(argv[1]);
+    listenfd = open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
 
-    while (1) {
-        pthread_t tid;
+    // Block SIGUSR1 before any thread starts so only stats_thread takes it
+    static sigset_t statsMask;
+    sigemptyset(&statsMask);
+    sigaddset(&statsMask, SIGUSR1);
+    if (cacheFile != NULL) {
+        sigaddset(&statsMask, SIGTERM);
+        sigaddset(&statsMask, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &statsMask, NULL);
 
-        client_info client_data;
-        client_info *client = &client_data;
-        client->addrlen = sizeof(client->addr);
-        int *connfdp = malloc(sizeof(int));
-        *connfdp = accept(listenfd, (SA *)&client->addr, &client->addrlen);
+    upstream_init(keepalive);
+    cache = init_cache(shards, policy, admission);
+    if (cacheFile != NULL && snapshot_load(cacheFile)) {
+        snapshot_stats_t ns;
+        snapshot_stats(&ns);
+        fprintf(stderr, "Loaded %zu cached objects from %s\n", ns.loaded,
+                cacheFile);
+    }
+    pool = pool_init(workers, depth, handle_conn);
 
-        // if (client->connfd < 0) {
-        if (*connfdp < 0) {
-            perror("accept");
-            continue;
-        }
+    pthread_t tid;
+    pthread_create(&tid, NULL, stats_thread, &statsMask);
+    pthread_detach(tid);
+    if (cacheFile != NULL) {
+        pthread_create(&tid, NULL, snapshot_thread, NULL);
+        pthread_detach(tid);
+    }
 
-        /* Connection Thread is established; serve client */
-        pthread_create(&tid, NULL, thread, (void *)connfdp);
+    if (reactor_init(listenfd, dispatch) < 0) {
+        perror("reactor_init");
+        exit(1);
     }
-    // return 0;
+    reactor_run();
+    return 0;
 }
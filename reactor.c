@@ -0,0 +1,355 @@
+/*
+ * reactor.c - epoll event loop for accepting clients and buffering requests
+ *
+ * Every connection lives on an idle list ordered by the last time the client
+ * sent data, so expiring stale connections only ever looks at the head of the
+ * list. The list and the epoll set are touched by the reactor thread alone;
+ * once a connection is dispatched it belongs to whoever received it.
+ */
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "metrics.h"
+#include "request.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define SWEEP_INTERVAL_MS 1000
+#define BACKLOG_RETRY_MS 5
+#define RESUME_PIPE_SIZE (1024 * 1024)
+
+static int epfd = -1;
+static int listenfd = -1;
+static int resumeFds[2] = {-1, -1}; // Workers write conn_t pointers to [1]
+static dispatch_fn *dispatch;
+
+// epoll data.ptr for the resume pipe; NULL is the listening socket
+static char resumeMarker;
+
+// Sentinel for the idle list: next is the oldest connection
+static conn_t idle = {.prev = &idle, .next = &idle};
+
+// Sentinel for connections with a request that dispatch could not take yet,
+// oldest first. While any wait here the listening socket is not watched
+static conn_t backlog = {.prev = &backlog, .next = &backlog};
+static bool accepting = true;
+
+/*
+ * raise_fd_limit - lift the soft descriptor limit to the hard limit so the
+ *     reactor can hold tens of thousands of client sockets
+ */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int set_blocking(int fd, bool blocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+static void idle_unlink(conn_t *conn) {
+    conn->prev->next = conn->next;
+    conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+}
+
+/* list_append - link an unlinked connection at the young end of a list */
+static void list_append(conn_t *list, conn_t *conn) {
+    conn->prev = list->prev;
+    conn->next = list;
+    list->prev->next = conn;
+    list->prev = conn;
+}
+
+/* idle_touch - stamp the connection and move it to the young end */
+static void idle_touch(conn_t *conn, time_t now) {
+    if (conn->next != NULL) {
+        idle_unlink(conn);
+    }
+    conn->lastActive = now;
+    list_append(&idle, conn);
+}
+
+/* set_accepting - start or stop watching the listening socket */
+static void set_accepting(bool on) {
+    if (on != accepting) {
+        struct epoll_event ev = {.events = on ? EPOLLIN : 0};
+        ev.data.ptr = NULL;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, listenfd, &ev);
+        accepting = on;
+    }
+}
+
+/* drain_backlog - dispatch waiting connections, oldest first, until dispatch
+   refuses one; accept again once none are left */
+static void drain_backlog(void) {
+    while (backlog.next != &backlog) {
+        conn_t *conn = backlog.next;
+        idle_unlink(conn);
+        if (!dispatch(conn)) {
+            // back at the old end, where it came from
+            conn->next = backlog.next;
+            conn->prev = &backlog;
+            backlog.next->prev = conn;
+            backlog.next = conn;
+            return;
+        }
+    }
+    set_accepting(true);
+}
+
+/*
+ * head_complete - returns true if buf holds a blank line ending the request
+ *     head. Blank lines before the request line are skipped, as
+ *     request_parse skips them. Scanning starts at from, which lets a partial
+ *     head be rescanned only where new bytes arrived.
+ */
+static bool head_complete(const char *buf, size_t len, size_t from) {
+    const char *end = buf + len;
+    size_t start = 0;
+    while (start < len) {
+        size_t lf = buf[start] == '\r' ? start + 1 : start;
+        if (lf >= len || buf[lf] != '\n') {
+            break;
+        }
+        start = lf + 1;
+    }
+    from = from > start ? from : start;
+    for (const char *lf = request_find_lf(buf + from, end); lf != NULL;
+         lf = request_find_lf(lf + 1, end)) {
+        if (lf + 1 < end && lf[1] == '\n') {
+            return true;
+        }
+        if (lf + 2 < end && lf[1] == '\r' && lf[2] == '\n') {
+            return true;
+        }
+    }
+    return false;
+}
+
+void conn_close(conn_t *conn) {
+    metrics_add(METRIC_CONNECTIONS, -1);
+    close(conn->fd);
+    Free(conn);
+}
+
+bool conn_buffered_request(conn_t *conn) {
+    return head_complete(conn->rio.rio_bufptr, conn->rio.rio_cnt, 0);
+}
+
+void reactor_resume(conn_t *conn) {
+    // Keep the reactor's invariant that unread bytes start at rio_buf
+    rio_t *rp = &conn->rio;
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+
+    // The pipe is non-blocking: a worker must never wait on the reactor
+    if (write(resumeFds[1], &conn, sizeof(conn)) != sizeof(conn)) {
+        conn_close(conn);
+    }
+}
+
+/* reactor_drop - forget a connection the reactor still owns and close it */
+static void reactor_drop(conn_t *conn) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    idle_unlink(conn);
+    conn_close(conn);
+}
+
+/* reactor_handoff - give a connection with a full request head to dispatch,
+   or queue it behind the ones already waiting for it */
+static void reactor_handoff(conn_t *conn) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    idle_unlink(conn);
+    if (set_blocking(conn->fd, true) < 0) {
+        conn_close(conn);
+        return;
+    }
+    if (backlog.next == &backlog && dispatch(conn)) {
+        return;
+    }
+    list_append(&backlog, conn);
+    set_accepting(false);
+}
+
+/* watch - start watching a non-blocking client socket for request bytes */
+static bool watch(conn_t *conn, time_t now) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP};
+    ev.data.ptr = conn;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        conn_close(conn);
+        return false;
+    }
+    idle_touch(conn, now);
+    return true;
+}
+
+/* take_resumed - adopt persistent connections handed back by workers */
+static void take_resumed(time_t now) {
+    conn_t *conn;
+    while (read(resumeFds[0], &conn, sizeof(conn)) == sizeof(conn)) {
+        if (set_blocking(conn->fd, false) < 0) {
+            conn_close(conn);
+            continue;
+        }
+        watch(conn, now);
+    }
+}
+
+static void accept_clients(time_t now) {
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = accept4(listenfd, (struct sockaddr *)&addr, &addrlen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+
+        conn_t *conn = Malloc(sizeof(conn_t));
+        conn->fd = fd;
+        conn->addr = addr;
+        conn->addrlen = addrlen;
+        conn->prev = conn->next = NULL;
+        rio_readinitb(&conn->rio, fd);
+        metrics_add(METRIC_CONNECTIONS, 1);
+        watch(conn, now);
+    }
+}
+
+/*
+ * conn_readable - pull whatever the client has sent into its rio buffer.
+ *     The buffer is always compacted while the reactor owns the connection,
+ *     so new bytes are appended at rio_buf + rio_cnt.
+ */
+static void conn_readable(conn_t *conn, time_t now) {
+    rio_t *rp = &conn->rio;
+    size_t scanned = rp->rio_cnt > 2 ? rp->rio_cnt - 2 : 0;
+    bool eof = false;
+
+    while (rp->rio_cnt < RIO_BUFSIZE) {
+        ssize_t n = read(conn->fd, rp->rio_buf + rp->rio_cnt,
+                         RIO_BUFSIZE - rp->rio_cnt);
+        if (n > 0) {
+            rp->rio_cnt += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        eof = true; // Orderly shutdown or a socket error
+        break;
+    }
+
+    // A head too large for the buffer is handed on too, for serve() to
+    // answer 431
+    if (rp->rio_cnt == RIO_BUFSIZE ||
+        head_complete(rp->rio_buf, rp->rio_cnt, scanned)) {
+        reactor_handoff(conn);
+    } else if (eof) {
+        reactor_drop(conn);
+    } else {
+        idle_touch(conn, now);
+    }
+}
+
+/* sweep_idle - close connections that have not completed a request in time */
+static void sweep_idle(time_t now) {
+    while (idle.next != &idle &&
+           idle.next->lastActive + CONN_IDLE_TIMEOUT <= now) {
+        reactor_drop(idle.next);
+    }
+}
+
+int reactor_init(int fd, dispatch_fn *fn) {
+    raise_fd_limit();
+
+    if (set_blocking(fd, false) < 0) {
+        return -1;
+    }
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(epfd);
+        return -1;
+    }
+
+    if (pipe2(resumeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        close(epfd);
+        return -1;
+    }
+    fcntl(resumeFds[1], F_SETPIPE_SZ, RESUME_PIPE_SIZE);
+    ev.data.ptr = &resumeMarker;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, resumeFds[0], &ev) < 0) {
+        close(epfd);
+        return -1;
+    }
+    listenfd = fd;
+    dispatch = fn;
+    return 0;
+}
+
+void reactor_run(void) {
+    struct epoll_event events[MAX_EVENTS];
+    time_t lastSweep = time(NULL);
+
+    while (true) {
+        // Nothing says when the workers catch up, so a backlog is retried
+        // on a short timeout
+        int timeout = backlog.next != &backlog ? BACKLOG_RETRY_MS
+                                               : SWEEP_INTERVAL_MS;
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        time_t now = time(NULL);
+        drain_backlog();
+        for (int i = 0; i < n; i++) {
+            conn_t *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_clients(now);
+            } else if ((void *)conn == &resumeMarker) {
+                take_resumed(now);
+            } else {
+                conn_readable(conn, now);
+            }
+        }
+
+        if (now != lastSweep) {
+            sweep_idle(now);
+            lastSweep = now;
+        }
+    }
+}
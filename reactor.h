@@ -0,0 +1,61 @@
+/*
+ * reactor.h - epoll-driven front end for client connections
+ *
+ * The reactor owns every client socket while the client is idle or still
+ * sending its request head. Sockets stay non-blocking and are watched by a
+ * single epoll instance, so a slow or idle client costs one conn_t and no
+ * thread. Once a complete request head is buffered in the connection's rio_t
+ * the socket is switched back to blocking mode and handed to the dispatch
+ * callback, which runs the connect and relay phases of the request. The
+ * reactor never waits on it: connections it cannot take yet queue in a
+ * backlog, and no new clients are accepted until that drains.
+ *
+ * A persistent connection comes back to the reactor through reactor_resume()
+ * once its worker has answered every request it had buffered, and waits in
+ * epoll for the next one like a newly accepted client.
+ */
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "csapp.h"
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/* Seconds a client may sit on a connection without completing a request,
+   including between requests on a persistent connection */
+#define CONN_IDLE_TIMEOUT 60
+
+/* Information about a connected client. */
+typedef struct conn {
+    int fd;                       // Client connection file descriptor
+    struct sockaddr_storage addr; // Socket address
+    socklen_t addrlen;            // Socket address length
+    rio_t rio;                    // Buffered request bytes, read by serve()
+    time_t lastActive;            // Last time the client sent us anything
+    struct conn *prev;            // Idle list links (reactor thread only)
+    struct conn *next;
+} conn_t;
+
+/* Callback run once a request head has been buffered for a connection;
+   returns false, without waiting, if it cannot take the connection yet */
+typedef bool dispatch_fn(conn_t *conn);
+
+/*reactor_init: set up epoll around listenfd; returns -1 on error*/
+int reactor_init(int listenfd, dispatch_fn *dispatch);
+
+/*reactor_run: accept and buffer requests forever on the calling thread*/
+void reactor_run(void);
+
+/*conn_close: close the client socket and free the connection*/
+void conn_close(conn_t *conn);
+
+/*conn_buffered_request: true if a complete pipelined request head is already
+  buffered in conn->rio*/
+bool conn_buffered_request(conn_t *conn);
+
+/*reactor_resume: hand a persistent connection back to the reactor to wait
+  for its next request; callable from any thread*/
+void reactor_resume(conn_t *conn);
+
+#endif /* REACTOR_H */
@@ -0,0 +1,223 @@
+/*
+ * request.c - zero-copy request head parser
+ */
+#include "request.h"
+
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+const char *request_find_lf(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    return p < end ? memchr(p, '\n', end - p) : NULL;
+}
+
+void request_init(request_t *req) {
+    memset(req, 0, offsetof(request_t, headers));
+    req->nheaders = 0;
+}
+
+static slice_t make_slice(const char *buf, const char *p, const char *end) {
+    slice_t s = {.off = (uint32_t)(p - buf), .len = (uint32_t)(end - p)};
+    return s;
+}
+
+/* find_byte - first c in [p, end), or end */
+static const char *find_byte(const char *p, const char *end, char c) {
+    const char *q = memchr(p, c, end - p);
+    return q != NULL ? q : end;
+}
+
+/*
+ * parse_uri - split an absolute http URI into scheme, host, port and path.
+ *     An origin-form target ("/...") is only a path, with no scheme or host:
+ *     a request for the proxy's own pages rather than one to forward.
+ */
+static bool parse_uri(request_t *req, const char *p, const char *end) {
+    const char *buf = req->buf;
+    if (*p == '/') {
+        req->path = make_slice(buf, p, end);
+        return true;
+    }
+    if (end - p < 7 || strncasecmp(p, "http://", 7) != 0) {
+        return false;
+    }
+    req->scheme = make_slice(buf, p, p + 4);
+    p += 7;
+
+    const char *authEnd = p;
+    while (authEnd < end && *authEnd != '/' && *authEnd != '?') {
+        authEnd++;
+    }
+
+    const char *hostEnd;
+    const char *portStart;
+    if (p < authEnd && *p == '[') {
+        hostEnd = find_byte(p, authEnd, ']');
+        if (hostEnd == authEnd) {
+            return false;
+        }
+        req->host = make_slice(buf, p + 1, hostEnd);
+        portStart = hostEnd + 1;
+    } else {
+        hostEnd = find_byte(p, authEnd, ':');
+        req->host = make_slice(buf, p, hostEnd);
+        portStart = hostEnd;
+    }
+    if (req->host.len == 0) {
+        return false;
+    }
+
+    if (portStart < authEnd) {
+        if (*portStart != ':') {
+            return false;
+        }
+        portStart++;
+        for (const char *q = portStart; q < authEnd; q++) {
+            if (*q < '0' || *q > '9') {
+                return false;
+            }
+        }
+        req->port = make_slice(buf, portStart, authEnd);
+    }
+
+    req->path = make_slice(buf, authEnd, end);
+    return true;
+}
+
+/* parse_request_line - METHOD SP absolute-URI SP HTTP/x.y */
+static bool parse_request_line(request_t *req, const char *p,
+                               const char *end) {
+    const char *sp1 = find_byte(p, end, ' ');
+    if (sp1 == p || sp1 == end) {
+        return false;
+    }
+    const char *uri = sp1 + 1;
+    const char *sp2 = find_byte(uri, end, ' ');
+    if (sp2 == uri || sp2 == end) {
+        return false;
+    }
+    const char *version = sp2 + 1;
+    if (end - version < 6 || strncmp(version, "HTTP/", 5) != 0) {
+        return false;
+    }
+
+    req->method = make_slice(req->buf, p, sp1);
+    req->uri = make_slice(req->buf, uri, sp2);
+    req->version = make_slice(req->buf, version + 5, end);
+    return parse_uri(req, uri, sp2);
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/* parse_header - Name: value, with optional whitespace around the value */
+static bool parse_header(request_t *req, const char *p, const char *end) {
+    const char *colon = find_byte(p, end, ':');
+    if (colon == p || colon == end || req->nheaders == REQUEST_MAX_HEADERS) {
+        return false;
+    }
+    for (const char *q = p; q < colon; q++) {
+        if (is_space(*q)) {
+            return false;
+        }
+    }
+
+    const char *value = colon + 1;
+    while (value < end && is_space(*value)) {
+        value++;
+    }
+    const char *valueEnd = end;
+    while (valueEnd > value && is_space(valueEnd[-1])) {
+        valueEnd--;
+    }
+
+    req_header_t *h = &req->headers[req->nheaders++];
+    h->name = make_slice(req->buf, p, colon);
+    h->value = make_slice(req->buf, value, valueEnd);
+    return true;
+}
+
+req_state request_parse(request_t *req, const char *buf, size_t len) {
+    const char *end = buf + len;
+    req->buf = buf;
+
+    while (true) {
+        const char *line = buf + req->scanned;
+        const char *lf = request_find_lf(line, end);
+        if (lf == NULL) {
+            return REQ_INCOMPLETE;
+        }
+        const char *lineEnd = (lf > line && lf[-1] == '\r') ? lf - 1 : lf;
+        req->scanned = lf + 1 - buf;
+
+        if (!req->haveLine) {
+            if (lineEnd == line) {
+                continue; // Stray blank lines before a request are allowed
+            }
+            if (!parse_request_line(req, line, lineEnd)) {
+                return REQ_ERROR;
+            }
+            req->haveLine = true;
+        } else if (lineEnd == line) {
+            req->headLen = req->scanned;
+            return REQ_COMPLETE;
+        } else if (!parse_header(req, line, lineEnd)) {
+            return REQ_ERROR;
+        }
+    }
+}
+
+bool request_copy(const request_t *req, slice_t s, char *out, size_t n) {
+    if (s.len >= n) {
+        return false;
+    }
+    memcpy(out, request_ptr(req, s), s.len);
+    out[s.len] = '\0';
+    return true;
+}
+
+bool request_is(const request_t *req, slice_t s, const char *text) {
+    return strlen(text) == s.len &&
+           memcmp(request_ptr(req, s), text, s.len) == 0;
+}
+
+bool request_contains(const request_t *req, slice_t s, const char *token) {
+    size_t n = strlen(token);
+    const char *p = request_ptr(req, s);
+    for (size_t i = 0; n <= s.len && i <= s.len - n; i++) {
+        if (strncasecmp(p + i, token, n) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool request_header_is(const request_t *req, const req_header_t *h,
+                       const char *name) {
+    return strlen(name) == h->name.len &&
+           strncasecmp(request_ptr(req, h->name), name, h->name.len) == 0;
+}
+
+const req_header_t *request_header(const request_t *req, const char *name) {
+    for (size_t i = 0; i < req->nheaders; i++) {
+        if (request_header_is(req, &req->headers[i], name)) {
+            return &req->headers[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,93 @@
+/*
+ * request.h - in-tree incremental parser for HTTP request heads
+ *
+ * The parser works directly on the bytes the reactor buffered for a
+ * connection. It never copies or allocates: every field it recognizes comes
+ * back as an offset/length slice into that buffer, so the buffer must stay
+ * untouched for as long as the request_t is used.
+ *
+ * Parsing is incremental. request_parse() may be called again after more
+ * bytes are appended to the same buffer, and resumes at the first line it
+ * has not finished yet. Lines may end in CRLF or a bare LF.
+ */
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Headers kept per request; a request with more is rejected */
+#define REQUEST_MAX_HEADERS 64
+
+/* A run of bytes in the parsed buffer; len 0 means the field was absent. */
+typedef struct slice {
+    uint32_t off;
+    uint32_t len;
+} slice_t;
+
+typedef struct req_header {
+    slice_t name;
+    slice_t value; // Surrounding whitespace trimmed
+} req_header_t;
+
+typedef enum {
+    REQ_INCOMPLETE, // No blank line yet: feed more bytes
+    REQ_COMPLETE,   // Head parsed; headLen bytes belong to it
+    REQ_ERROR       // Malformed request line or header
+} req_state;
+
+typedef struct request {
+    const char *buf;   // Buffer the slices point into
+    size_t scanned;    // Offset of the first line not parsed yet
+    bool haveLine;     // Request line parsed
+    size_t headLen;    // Bytes of head, blank line included, once complete
+
+    slice_t method;
+    slice_t uri;     // Whole absolute URI, or the path of an origin-form one
+    slice_t scheme;  // "http", absent for an origin-form URI
+    slice_t host;    // Without brackets for IPv6 literals; absent as scheme
+    slice_t port;    // Absent means the default, REQUEST_DEFAULT_PORT
+    slice_t path;    // Absent means "/"
+    slice_t version; // After "HTTP/", e.g. 1.1
+
+    req_header_t headers[REQUEST_MAX_HEADERS];
+    size_t nheaders;
+} request_t;
+
+#define REQUEST_DEFAULT_PORT "80"
+
+/*request_find_lf: first '\n' in [p, end), or NULL; scans 16 bytes at a
+  time with SSE2 where available*/
+const char *request_find_lf(const char *p, const char *end);
+
+/*request_init: reset a request_t before parsing a new head*/
+void request_init(request_t *req);
+
+/*request_parse: parse the head in buf[0, len), continuing where the last call
+  on the same buffer stopped*/
+req_state request_parse(request_t *req, const char *buf, size_t len);
+
+/*request_ptr: start of a slice's bytes*/
+static inline const char *request_ptr(const request_t *req, slice_t s) {
+    return req->buf + s.off;
+}
+
+/*request_copy: NUL-terminated copy of a slice into out; false if it does not
+  fit in n bytes*/
+bool request_copy(const request_t *req, slice_t s, char *out, size_t n);
+
+/*request_is: true if the slice is exactly text (case-sensitive)*/
+bool request_is(const request_t *req, slice_t s, const char *text);
+
+/*request_contains: true if the slice contains token, ignoring case*/
+bool request_contains(const request_t *req, slice_t s, const char *token);
+
+/*request_header: first header called name (ignoring case), or NULL*/
+const req_header_t *request_header(const request_t *req, const char *name);
+
+/*request_header_is: true if the header's name is name, ignoring case*/
+bool request_header_is(const request_t *req, const req_header_t *h,
+                       const char *name);
+
+#endif /* REQUEST_H */
@@ -0,0 +1,498 @@
+/*
+ * segment.c - chunks of large objects in one budgeted LRU behind a mutex
+ *
+ * Objects live in a hash table by URI, each with an array of its chunks, a
+ * NULL slot for every chunk not present. All chunks of all objects are on
+ * one LRU list, so the budget is shared: the least recently used chunk goes
+ * first, whichever object it belongs to. The mutex is held only to look
+ * things up and relink them; chunks are allocated and filled without it,
+ * and a reader pins a chunk the way the memory cache pins blocks.
+ */
+#include "segment.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* One large object: its response head and its chunks */
+typedef struct segment_object {
+    char *key;
+    char *etag;   // validator, after the key; "" if none
+    char *fields; // header lines, after the etag
+    size_t fieldsLen;
+    char version[16];
+    unsigned long long id;
+    long long length;
+    bool keepAlive;
+    time_t expires;      // 0 for never
+    time_t lastModified; // validator, -1 if none
+    segment_chunk_t **chunks; // nchunks slots, NULL where not present
+    size_t nchunks;
+    size_t present;
+    size_t bytes; // charged to the budget, its chunks aside
+    struct segment_object *hnext; // next object in the same bucket
+    struct segment_object *newer; // creation order, oldest at the list head
+    struct segment_object *older;
+} segment_object_t;
+
+static bool enabled;
+static size_t budget;
+static unsigned long long nextId;
+
+static segment_object_t *table[SEGMENT_BUCKETS];
+static segment_object_t *oldest;
+static segment_object_t *newest;
+static segment_chunk_t *head; // most recently used chunk
+static segment_chunk_t *tail;
+static size_t objects;
+static size_t chunks;
+static size_t bytes;
+static pthread_mutex_t segmentLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long hits;
+static unsigned long misses;
+static unsigned long fills;
+static unsigned long evictions;
+static unsigned long expirations;
+
+static segment_object_t **bucket_of(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return &table[h % SEGMENT_BUCKETS];
+}
+
+static segment_object_t *find(const char *key) {
+    segment_object_t *o = *bucket_of(key);
+    while (o != NULL && strcmp(o->key, key) != 0) {
+        o = o->hnext;
+    }
+    return o;
+}
+
+static size_t chunk_cost(const segment_chunk_t *c) {
+    return sizeof(segment_chunk_t) + c->size;
+}
+
+static void lru_unlink(segment_chunk_t *c) {
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        head = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    } else {
+        tail = c->prev;
+    }
+    c->next = c->prev = NULL;
+}
+
+static void lru_push(segment_chunk_t *c) {
+    c->prev = NULL;
+    c->next = head;
+    if (head != NULL) {
+        head->prev = c;
+    } else {
+        tail = c;
+    }
+    head = c;
+}
+
+/* unlink_chunk - take a chunk out of its object and the LRU, dropping the
+   store's reference; caller holds segmentLock */
+static void unlink_chunk(segment_chunk_t *c) {
+    segment_object_t *o = c->object;
+    lru_unlink(c);
+    o->chunks[c->index] = NULL;
+    o->present--;
+    c->object = NULL;
+    chunks--;
+    bytes -= chunk_cost(c);
+    segment_release(c);
+}
+
+/* drop_object - unlink an object and all its chunks and free it; caller
+   holds segmentLock */
+static void drop_object(segment_object_t *o) {
+    for (size_t i = 0; o->present > 0 && i < o->nchunks; i++) {
+        if (o->chunks[i] != NULL) {
+            unlink_chunk(o->chunks[i]);
+        }
+    }
+    segment_object_t **pp = bucket_of(o->key);
+    while (*pp != o) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = o->hnext;
+
+    if (o->older != NULL) {
+        o->older->newer = o->newer;
+    } else {
+        oldest = o->newer;
+    }
+    if (o->newer != NULL) {
+        o->newer->older = o->older;
+    } else {
+        newest = o->older;
+    }
+    objects--;
+    bytes -= o->bytes;
+    free(o->chunks);
+    free(o);
+}
+
+/* live - the fresh object under key, dropping a stale one found on the way;
+   caller holds segmentLock */
+static segment_object_t *live(const char *key, time_t now) {
+    segment_object_t *o = find(key);
+    if (o != NULL && o->expires != 0 && o->expires <= now) {
+        drop_object(o);
+        expirations++;
+        return NULL;
+    }
+    return o;
+}
+
+/* evict - drop least recently used chunks, then the oldest objects left
+   with none, until the store fits its budget; keep is never dropped.
+   Caller holds segmentLock */
+static void evict(segment_object_t *keep) {
+    while (bytes > budget && tail != NULL) {
+        segment_object_t *o = tail->object;
+        unlink_chunk(tail);
+        evictions++;
+        if (o->present == 0 && o != keep) {
+            drop_object(o);
+        }
+    }
+    segment_object_t *next;
+    for (segment_object_t *o = oldest; bytes > budget && o != NULL;
+         o = next) {
+        next = o->newer;
+        if (o != keep) {
+            drop_object(o);
+        }
+    }
+}
+
+/*
+ * parse_head - the status line's HTTP version and the header lines of a
+ *     response head, leaving out the ones that frame this response's body
+ *     rather than the object's. False if the head is not one we can keep.
+ */
+static bool parse_head(const char *buf, size_t len, char *version,
+                       char *fields, size_t *fieldsLen) {
+    static const char *const framing[] = {"Content-Length", "Content-Range",
+                                          "Transfer-Encoding"};
+    const char *end = buf + len;
+    bool first = true;
+    *fieldsLen = 0;
+
+    for (const char *line = buf; line < end;) {
+        const char *lf = memchr(line, '\n', end - line);
+        const char *next = lf != NULL ? lf + 1 : end;
+        size_t n = (lf != NULL ? lf : end) - line;
+        if (n > 0 && line[n - 1] == '\r') {
+            n--;
+        }
+
+        if (first) {
+            const char *space = memchr(line, ' ', n);
+            size_t vlen = space != NULL ? (size_t)(space - line) : 0;
+            if (vlen == 0 || vlen >= 16 || strncmp(line, "HTTP/", 5) != 0) {
+                return false;
+            }
+            memcpy(version, line, vlen);
+            version[vlen] = '\0';
+            first = false;
+        } else if (n == 0) {
+            break;
+        } else {
+            const char *colon = memchr(line, ':', n);
+            size_t name = colon != NULL ? (size_t)(colon - line) : n;
+            bool skip = false;
+            for (size_t i = 0; i < sizeof(framing) / sizeof(framing[0]); i++) {
+                skip = skip || (strlen(framing[i]) == name &&
+                                strncasecmp(line, framing[i], name) == 0);
+            }
+            if (!skip) {
+                if (*fieldsLen + n + 2 > SEGMENT_MAX_FIELDS) {
+                    return false;
+                }
+                memcpy(fields + *fieldsLen, line, n);
+                memcpy(fields + *fieldsLen + n, "\r\n", 2);
+                *fieldsLen += n + 2;
+            }
+        }
+        line = next;
+    }
+    return !first;
+}
+
+/* same_version - true if meta describes the body o already holds chunks of */
+static bool same_version(const segment_object_t *o,
+                         const segment_meta_t *meta) {
+    return o->length == meta->length &&
+           o->lastModified == meta->lastModified &&
+           strcmp(o->etag, meta->etag) == 0;
+}
+
+void segment_init(size_t limit) {
+    budget = limit;
+    enabled = true;
+}
+
+bool segment_enabled(void) {
+    return enabled;
+}
+
+bool segment_open(const char *key, segment_info_t *info) {
+    pthread_mutex_lock(&segmentLock);
+    segment_object_t *o = live(key, time(NULL));
+    if (o != NULL) {
+        info->id = o->id;
+        info->length = o->length;
+        info->keepAlive = o->keepAlive;
+        strcpy(info->version, o->version);
+        memcpy(info->fields, o->fields, o->fieldsLen);
+        info->fieldsLen = o->fieldsLen;
+    }
+    pthread_mutex_unlock(&segmentLock);
+    return o != NULL;
+}
+
+segment_chunk_t *segment_get(const char *key, unsigned long long id,
+                             size_t index) {
+    segment_chunk_t *c = NULL;
+    pthread_mutex_lock(&segmentLock);
+    segment_object_t *o = find(key);
+    if (o != NULL && o->id == id && index < o->nchunks) {
+        c = o->chunks[index];
+        if (c != NULL) {
+            __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+            lru_unlink(c);
+            lru_push(c);
+            hits++;
+        } else {
+            misses++;
+        }
+    }
+    pthread_mutex_unlock(&segmentLock);
+    return c;
+}
+
+bool segment_has(const char *key, unsigned long long id, size_t index) {
+    pthread_mutex_lock(&segmentLock);
+    segment_object_t *o = find(key);
+    bool has = o != NULL && o->id == id && index < o->nchunks &&
+               o->chunks[index] != NULL;
+    pthread_mutex_unlock(&segmentLock);
+    return has;
+}
+
+void segment_release(segment_chunk_t *chunk) {
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(chunk); // data shares its allocation
+    }
+}
+
+size_t segment_head(const segment_info_t *info, bool partial,
+                    long long first, long long last, char *buf, size_t n) {
+    int len;
+    if (partial) {
+        len = snprintf(buf, n,
+                       "%s 206 Partial Content\r\n%.*s"
+                       "Content-Range: bytes %lld-%lld/%lld\r\n"
+                       "Content-Length: %lld\r\n\r\n",
+                       info->version, (int)info->fieldsLen, info->fields,
+                       first, last, info->length, last - first + 1);
+    } else {
+        len = snprintf(buf, n, "%s 200 OK\r\n%.*sContent-Length: %lld\r\n\r\n",
+                       info->version, (int)info->fieldsLen, info->fields,
+                       info->length);
+    }
+    return (size_t)len < n ? (size_t)len : n - 1;
+}
+
+bool segment_fill_begin(segment_fill_t *fill, const char *key,
+                        const char *head, size_t headLen,
+                        const segment_meta_t *meta) {
+    char version[16];
+    char fields[SEGMENT_MAX_FIELDS];
+    size_t fieldsLen;
+    if (!enabled || meta->length <= 0 || meta->offset < 0 ||
+        meta->offset >= meta->length ||
+        !parse_head(head, headLen, version, fields, &fieldsLen)) {
+        return false;
+    }
+
+    // Built before taking the lock, and thrown away if the object is known
+    size_t nchunks = (meta->length + SEGMENT_CHUNK - 1) / SEGMENT_CHUNK;
+    size_t keyLen = strlen(key) + 1;
+    size_t etagLen = strlen(meta->etag) + 1;
+    size_t cost = sizeof(segment_object_t) + keyLen + etagLen + fieldsLen +
+                  nchunks * sizeof(segment_chunk_t *);
+    if (cost > budget) {
+        return false;
+    }
+    segment_object_t *fresh = malloc(sizeof(segment_object_t) + keyLen +
+                                     etagLen + fieldsLen);
+    segment_chunk_t **slots = calloc(nchunks, sizeof(segment_chunk_t *));
+    if (fresh == NULL || slots == NULL) {
+        free(fresh);
+        free(slots);
+        return false;
+    }
+    fresh->key = (char *)(fresh + 1);
+    fresh->etag = fresh->key + keyLen;
+    fresh->fields = fresh->etag + etagLen;
+    memcpy(fresh->key, key, keyLen);
+    memcpy(fresh->etag, meta->etag, etagLen);
+    memcpy(fresh->fields, fields, fieldsLen);
+    fresh->fieldsLen = fieldsLen;
+    strcpy(fresh->version, version);
+    fresh->length = meta->length;
+    fresh->lastModified = meta->lastModified;
+    fresh->chunks = slots;
+    fresh->nchunks = nchunks;
+    fresh->present = 0;
+    fresh->bytes = cost;
+
+    pthread_mutex_lock(&segmentLock);
+    segment_object_t *o = live(key, time(NULL));
+    if (o != NULL && !same_version(o, meta)) {
+        drop_object(o);
+        o = NULL;
+    }
+    if (o == NULL) {
+        o = fresh;
+        fresh = NULL;
+        o->id = ++nextId;
+        segment_object_t **slot = bucket_of(key);
+        o->hnext = *slot;
+        *slot = o;
+        o->newer = NULL;
+        o->older = newest;
+        if (newest != NULL) {
+            newest->newer = o;
+        } else {
+            oldest = o;
+        }
+        newest = o;
+        objects++;
+        bytes += o->bytes;
+        evict(o);
+    }
+    // Whatever the origin just said about it is the latest word
+    o->keepAlive = meta->keepAlive;
+    o->expires = meta->expires;
+    fill->id = o->id;
+    pthread_mutex_unlock(&segmentLock);
+
+    if (fresh != NULL) {
+        free(fresh->chunks);
+        free(fresh);
+    }
+    fill->key = key;
+    fill->length = meta->length;
+    fill->pos = meta->offset;
+    fill->chunk = NULL;
+    return true;
+}
+
+/* start_chunk - a chunk to collect index into, or NULL if it is present
+   already or the object is gone */
+static segment_chunk_t *start_chunk(segment_fill_t *fill, size_t index,
+                                    size_t size) {
+    pthread_mutex_lock(&segmentLock);
+    segment_object_t *o = find(fill->key);
+    bool wanted = o != NULL && o->id == fill->id && o->chunks[index] == NULL;
+    pthread_mutex_unlock(&segmentLock);
+    if (!wanted) {
+        return NULL;
+    }
+
+    segment_chunk_t *c = malloc(sizeof(segment_chunk_t) + size);
+    if (c != NULL) {
+        c->refs = 1; // the store's, once linked
+        c->size = size;
+        c->index = index;
+        c->data = (char *)(c + 1);
+        c->object = NULL;
+        c->next = c->prev = NULL;
+    }
+    return c;
+}
+
+/* store_chunk - link a complete chunk into its object, unless another fill
+   got there first or the object has gone */
+static void store_chunk(segment_fill_t *fill, segment_chunk_t *c) {
+    pthread_mutex_lock(&segmentLock);
+    segment_object_t *o = find(fill->key);
+    if (o == NULL || o->id != fill->id || o->chunks[c->index] != NULL) {
+        pthread_mutex_unlock(&segmentLock);
+        free(c);
+        return;
+    }
+    o->chunks[c->index] = c;
+    o->present++;
+    c->object = o;
+    lru_push(c);
+    chunks++;
+    bytes += chunk_cost(c);
+    fills++;
+    evict(o);
+    pthread_mutex_unlock(&segmentLock);
+}
+
+void segment_fill_write(segment_fill_t *fill, const char *buf, size_t n) {
+    while (n > 0 && fill->pos < fill->length) {
+        size_t index = fill->pos / SEGMENT_CHUNK;
+        long long start = (long long)index * SEGMENT_CHUNK;
+        size_t size = fill->length - start < SEGMENT_CHUNK
+                          ? (size_t)(fill->length - start)
+                          : SEGMENT_CHUNK;
+        size_t off = fill->pos - start;
+
+        // Only a chunk whose every byte this body carries is collected
+        if (off == 0) {
+            fill->chunk = start_chunk(fill, index, size);
+        }
+        size_t take = n < size - off ? n : size - off;
+        if (fill->chunk != NULL) {
+            memcpy(fill->chunk->data + off, buf, take);
+        }
+        fill->pos += take;
+        buf += take;
+        n -= take;
+
+        if (off + take == size && fill->chunk != NULL) {
+            store_chunk(fill, fill->chunk);
+            fill->chunk = NULL;
+        }
+    }
+}
+
+void segment_fill_end(segment_fill_t *fill) {
+    free(fill->chunk);
+    fill->chunk = NULL;
+}
+
+void segment_stats(segment_stats_t *stats) {
+    pthread_mutex_lock(&segmentLock);
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->fills = fills;
+    stats->evictions = evictions;
+    stats->expirations = expirations;
+    stats->objects = objects;
+    stats->chunks = chunks;
+    stats->bytes = bytes;
+    stats->budget = budget;
+    pthread_mutex_unlock(&segmentLock);
+}
@@ -0,0 +1,131 @@
+/*
+ * segment.h - chunked byte-range store for objects too large to cache whole
+ *
+ * Responses bigger than MAX_OBJECT_SIZE are kept here as SEGMENT_CHUNK byte
+ * chunks keyed by (URI, chunk index), filled as their bodies stream through
+ * to the client. An object remembers its length and the header lines of its
+ * response, so it can be answered from whichever chunks are present: a
+ * plain GET gets the whole 200, a Range request a 206 of just its range.
+ * The chunks that are missing, because they were evicted or the body that
+ * would have filled them was never read, are fetched from the origin with a
+ * Range request of their own and stored on the way through.
+ *
+ * A response whose length or validators differ from the object's replaces
+ * it, and a stale object is dropped when it is looked up, so chunks of two
+ * versions are never mixed. Objects and chunks share a byte budget of their
+ * own; chunks are evicted least recently used first, and an object goes with
+ * its last chunk. Readers pin a chunk and send it with no lock held.
+ */
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Bytes per chunk; the last chunk of an object may be shorter */
+#define SEGMENT_CHUNK (64 * 1024)
+/* Header lines kept per object; responses with longer heads are not kept */
+#define SEGMENT_MAX_FIELDS 4096
+/* Room for a head built by segment_head */
+#define SEGMENT_HEAD_LEN (SEGMENT_MAX_FIELDS + 256)
+/* Hash buckets in the object index */
+#define SEGMENT_BUCKETS 1024
+
+/* One chunk of an object's body */
+typedef struct segment_chunk {
+    size_t refs;  // the store while linked, plus each reader, atomic
+    size_t size;  // SEGMENT_CHUNK but for an object's last chunk
+    size_t index; // position in the object
+    char *data;   // right after the chunk, in the same allocation
+    struct segment_object *object; // NULL once unlinked
+    struct segment_chunk *next;    // LRU order, most recently used at head
+    struct segment_chunk *prev;
+} segment_chunk_t;
+
+/* What a lookup copies out about an object */
+typedef struct segment_info {
+    unsigned long long id; // changes whenever the object is replaced
+    long long length;      // of the whole body
+    bool keepAlive;        // the response head lets the client persist
+    char version[16];      // of the response's status line, e.g. HTTP/1.1
+    char fields[SEGMENT_MAX_FIELDS]; // header lines, CRLF terminated
+    size_t fieldsLen;
+} segment_info_t;
+
+/* What a response being read says about the object it is part of */
+typedef struct segment_meta {
+    long long length;    // of the whole body, not just this response's
+    long long offset;    // where this response's body starts in it
+    bool keepAlive;      // the response head lets the client persist
+    time_t expires;      // when it goes stale, 0 for never
+    time_t lastModified; // validator, -1 if none
+    const char *etag;    // validator, "" if none
+} segment_meta_t;
+
+/* A response body being cut into chunks */
+typedef struct segment_fill {
+    const char *key;        // the URI, owned by the caller
+    unsigned long long id;  // of the object being filled
+    long long length;
+    long long pos;          // offset in the object of the next byte
+    segment_chunk_t *chunk; // being collected, NULL while skipping
+} segment_fill_t;
+
+/* Snapshot of the store's counters */
+typedef struct segment_stats {
+    unsigned long hits;        // chunks served from the store
+    unsigned long misses;      // chunks of a known object not present
+    unsigned long fills;       // chunks stored
+    unsigned long evictions;   // chunks dropped for the budget
+    unsigned long expirations; // stale objects dropped on lookup
+    size_t objects;
+    size_t chunks;
+    size_t bytes;
+    size_t budget;
+} segment_stats_t;
+
+/*segment_init: keep up to budget bytes of large objects*/
+void segment_init(size_t budget);
+
+/*segment_enabled: true once segment_init has been called*/
+bool segment_enabled(void);
+
+/*segment_open: copy out what is known about the fresh object cached under
+  key; false if there is none*/
+bool segment_open(const char *key, segment_info_t *info);
+
+/*segment_get: chunk index of object id under key, pinned, or NULL if it is
+  not present. The caller hands it back to segment_release*/
+segment_chunk_t *segment_get(const char *key, unsigned long long id,
+                             size_t index);
+
+/*segment_has: true if chunk index of object id under key is present*/
+bool segment_has(const char *key, unsigned long long id, size_t index);
+
+/*segment_release: drop one reference to a chunk, freeing it on the last*/
+void segment_release(segment_chunk_t *chunk);
+
+/*segment_head: the response head for bytes [first, last] of an object into
+  buf, a 206 if partial and the whole 200 otherwise; returns its length*/
+size_t segment_head(const segment_info_t *info, bool partial,
+                    long long first, long long last, char *buf, size_t n);
+
+/*segment_fill_begin: start cutting the body of a response with head
+  [head, head + headLen) into chunks of the object under key, creating or
+  replacing the object as meta says; false if it would not be kept*/
+bool segment_fill_begin(segment_fill_t *fill, const char *key,
+                        const char *head, size_t headLen,
+                        const segment_meta_t *meta);
+
+/*segment_fill_write: the next n body bytes; each chunk they complete is
+  stored unless it is already present*/
+void segment_fill_write(segment_fill_t *fill, const char *buf, size_t n);
+
+/*segment_fill_end: finish a fill, dropping a chunk left incomplete*/
+void segment_fill_end(segment_fill_t *fill);
+
+/*segment_stats: copy the current counters out*/
+void segment_stats(segment_stats_t *stats);
+
+#endif /* SEGMENT_H */
@@ -0,0 +1,219 @@
+/*
+ * slab.c - size-class arena: pages from one mapping, chunks from pages
+ */
+#define _GNU_SOURCE
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define SLAB_MAX_CLASSES 64
+
+/* Per-page bookkeeping, kept outside the pages themselves */
+typedef struct slab_page {
+    int cls;                // size class, -1 while the page is free
+    size_t inuse;           // chunks handed out
+    size_t carved;          // chunks cut from the page so far
+    void *free;             // freed chunks, linked through their first word
+    struct slab_page *next; // in its class's partial list or the free pool
+    struct slab_page *prev;
+} slab_page_t;
+
+/* A size class and its pages that still have room */
+typedef struct slab_class {
+    size_t size;
+    size_t perPage;
+    slab_page_t *partial;
+} slab_class_t;
+
+static char *base;
+static size_t npages;
+static slab_page_t *pages;
+static slab_page_t *freePages;
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int nclasses;
+static bool huge;
+static pthread_mutex_t slabLock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t pagesUsed;
+static size_t chunkBytes;
+static size_t overflow;
+static unsigned long allocs;
+
+/* map_arena - explicit huge pages if configured, else ask for THP */
+static char *map_arena(size_t bytes) {
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        huge = true;
+        return p;
+    }
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(p, bytes, MADV_HUGEPAGE); // a hint; failure is harmless
+    return p;
+}
+
+static void list_remove(slab_page_t **head, slab_page_t *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        *head = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->next = NULL;
+    page->prev = NULL;
+}
+
+static void list_add(slab_page_t **head, slab_page_t *page) {
+    page->prev = NULL;
+    page->next = *head;
+    if (*head != NULL) {
+        (*head)->prev = page;
+    }
+    *head = page;
+}
+
+void slab_init(size_t bytes) {
+    size_t size = SLAB_MIN_CHUNK;
+    while (nclasses < SLAB_MAX_CLASSES - 1 && size < SLAB_PAGE_SIZE) {
+        classes[nclasses++].size = size;
+        size_t next = size + size / 4;
+        size = (next + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    }
+    classes[nclasses++].size = SLAB_PAGE_SIZE;
+    for (int c = 0; c < nclasses; c++) {
+        classes[c].perPage = SLAB_PAGE_SIZE / classes[c].size;
+        classes[c].partial = NULL;
+    }
+
+    bytes = (bytes + SLAB_HUGE_PAGE - 1) / SLAB_HUGE_PAGE * SLAB_HUGE_PAGE;
+    base = map_arena(bytes);
+    pages = calloc(bytes / SLAB_PAGE_SIZE, sizeof(slab_page_t));
+    if (base == NULL || pages == NULL) {
+        // No arena: every allocation overflows to malloc
+        fprintf(stderr, "slab: could not map a %zu byte arena\n", bytes);
+        return;
+    }
+    npages = bytes / SLAB_PAGE_SIZE;
+    for (size_t i = npages; i-- > 0;) {
+        pages[i].cls = -1;
+        list_add(&freePages, &pages[i]);
+    }
+}
+
+/* class_of - smallest class that fits n bytes, -1 if none does */
+static int class_of(size_t n) {
+    int lo = 0;
+    int hi = nclasses;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (classes[mid].size < n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < nclasses ? lo : -1;
+}
+
+/* page_of - the page holding p, NULL if p is not in the arena */
+static slab_page_t *page_of(void *p) {
+    char *c = p;
+    if (base == NULL || c < base || c >= base + npages * SLAB_PAGE_SIZE) {
+        return NULL;
+    }
+    return &pages[(c - base) / SLAB_PAGE_SIZE];
+}
+
+void *slab_alloc(size_t n) {
+    int c = class_of(n);
+    void *chunk = NULL;
+
+    pthread_mutex_lock(&slabLock);
+    if (c >= 0) {
+        slab_class_t *cls = &classes[c];
+        slab_page_t *page = cls->partial;
+        if (page == NULL && freePages != NULL) {
+            page = freePages;
+            list_remove(&freePages, page);
+            page->cls = c;
+            page->inuse = 0;
+            page->carved = 0;
+            page->free = NULL;
+            list_add(&cls->partial, page);
+            pagesUsed++;
+        }
+        if (page != NULL) {
+            if (page->free != NULL) {
+                chunk = page->free;
+                page->free = *(void **)chunk;
+            } else {
+                chunk = base + (page - pages) * SLAB_PAGE_SIZE +
+                        page->carved++ * cls->size;
+            }
+            if (++page->inuse == cls->perPage) {
+                list_remove(&cls->partial, page);
+            }
+            chunkBytes += cls->size;
+            allocs++;
+        }
+    }
+    if (chunk == NULL) {
+        overflow++;
+    }
+    pthread_mutex_unlock(&slabLock);
+
+    return chunk != NULL ? chunk : malloc(n);
+}
+
+void slab_free(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    slab_page_t *page = page_of(p);
+    pthread_mutex_lock(&slabLock);
+    if (page == NULL) {
+        overflow--;
+        pthread_mutex_unlock(&slabLock);
+        free(p);
+        return;
+    }
+
+    slab_class_t *cls = &classes[page->cls];
+    if (page->inuse-- == cls->perPage) {
+        list_add(&cls->partial, page); // was full
+    }
+    chunkBytes -= cls->size;
+    if (page->inuse == 0) {
+        // Empty: give the page back so any class can use it
+        list_remove(&cls->partial, page);
+        page->cls = -1;
+        list_add(&freePages, page);
+        pagesUsed--;
+    } else {
+        *(void **)p = page->free;
+        page->free = p;
+    }
+    pthread_mutex_unlock(&slabLock);
+}
+
+void slab_stats(slab_stats_t *stats) {
+    pthread_mutex_lock(&slabLock);
+    stats->arenaBytes = npages * SLAB_PAGE_SIZE;
+    stats->hugePages = huge;
+    stats->pagesUsed = pagesUsed;
+    stats->pages = npages;
+    stats->chunkBytes = chunkBytes;
+    stats->overflow = overflow;
+    stats->allocs = allocs;
+    pthread_mutex_unlock(&slabLock);
+}
@@ -0,0 +1,54 @@
+/*
+ * slab.h - size-class arena for cache blocks
+ *
+ * Cached objects are allocated from one region mapped up front, backed by
+ * huge pages where the kernel provides them. The region is cut into
+ * SLAB_PAGE_SIZE pages; a page serves a single size class at a time and goes
+ * back to the shared pool as soon as its last chunk is freed, so memory moves
+ * to whichever sizes the workload needs. Size classes grow by about 25%, which
+ * bounds the space lost to rounding.
+ *
+ * Requests larger than a page, or made while every page is taken, fall back
+ * to malloc and are counted as overflow, so the arena size caps the memory it
+ * owns but never refuses an allocation.
+ */
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bytes per slab page; also the largest chunk */
+#define SLAB_PAGE_SIZE (128 * 1024)
+/* Smallest chunk */
+#define SLAB_MIN_CHUNK 64
+/* Chunks are multiples of this, so block headers stay aligned */
+#define SLAB_ALIGN 16
+/* Huge page size the arena is rounded to */
+#define SLAB_HUGE_PAGE (2 * 1024 * 1024)
+
+/* Snapshot of the arena's accounting */
+typedef struct slab_stats {
+    size_t arenaBytes;    // mapped for the arena
+    bool hugePages;       // arena backed by explicit huge pages
+    size_t pagesUsed;     // pages assigned to a size class
+    size_t pages;         // pages in the arena
+    size_t chunkBytes;    // bytes in chunks handed out
+    size_t overflow;      // live allocations that fell back to malloc
+    unsigned long allocs; // chunks handed out, ever
+} slab_stats_t;
+
+/*slab_init: map an arena of at least bytes; call once before slab_alloc*/
+void slab_init(size_t bytes);
+
+/*slab_alloc: n bytes from the arena, or from malloc if it cannot serve them;
+  NULL only if both are out of memory*/
+void *slab_alloc(size_t n);
+
+/*slab_free: return memory from slab_alloc*/
+void slab_free(void *p);
+
+/*slab_stats: copy the current accounting out*/
+void slab_stats(slab_stats_t *stats);
+
+#endif /* SLAB_H */
@@ -0,0 +1,366 @@
+/*
+ * snapshot.c - write the cache to a file, map it back lazily on startup
+ */
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECKSUM_SEED 14695981039346656037ULL
+
+/* A loaded record and whether it has been handed out */
+typedef struct snap_entry {
+    const snap_record_t *rec;
+    int taken; // claimed with an atomic exchange
+    struct snap_entry *next;
+} snap_entry_t;
+
+static const char *map;
+static snap_entry_t *entries;
+static snap_entry_t **buckets;
+static size_t nbuckets; // power of two
+static pthread_mutex_t saveLock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t loaded;
+static unsigned long taken;
+static unsigned long corrupt;
+static unsigned long saves;
+static size_t lastSize;
+
+/* checksum - continue a 64-bit FNV-1a checksum over n bytes */
+static uint64_t checksum(uint64_t sum, const void *p, size_t n) {
+    const unsigned char *c = p;
+    for (size_t i = 0; i < n; i++) {
+        sum ^= c[i];
+        sum *= 1099511628211ULL;
+    }
+    return sum;
+}
+
+static uint64_t header_checksum(const snap_header_t *header) {
+    return checksum(CHECKSUM_SEED, header,
+                    offsetof(snap_header_t, headerChecksum));
+}
+
+/* keep_until - when a record that has gone stale stops being worth keeping,
+   as the cache would reclaim it: after its stale-while-revalidate window, or
+   after CACHE_STALE_KEEP if it carries a validator */
+static time_t keep_until(const snap_record_t *r) {
+    time_t keep = r->staleWindow;
+    bool validator = r->etagLen > 0 || r->lastModified >= 0;
+    if (validator && keep < CACHE_STALE_KEEP) {
+        keep = CACHE_STALE_KEEP;
+    }
+    return r->expires + keep;
+}
+
+/* valid - check the header and record table of a mapped file */
+static bool valid(const char *base, size_t size) {
+    if (size < sizeof(snap_header_t)) {
+        return false;
+    }
+    const snap_header_t *header = (const snap_header_t *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        header->headerChecksum != header_checksum(header) ||
+        header->size != size ||
+        (size - sizeof(snap_header_t)) / sizeof(snap_record_t) <
+            header->count) {
+        return false;
+    }
+    const snap_record_t *recs =
+        (const snap_record_t *)(base + sizeof(snap_header_t));
+    size_t tableSize = header->count * sizeof(snap_record_t);
+    if (checksum(CHECKSUM_SEED, recs, tableSize) != header->indexChecksum) {
+        return false;
+    }
+    for (uint32_t i = 0; i < header->count; i++) {
+        const snap_record_t *r = &recs[i];
+        if (r->keyLen == 0 || r->keyLen >= MAXLINE || r->etagLen >= MAXLINE ||
+            r->dataLen > MAX_OBJECT_SIZE || r->keyOff > size ||
+            size - r->keyOff < (uint64_t)r->keyLen + r->etagLen + 1 ||
+            r->dataOff > size || size - r->dataOff < r->dataLen ||
+            r->plainSize > MAX_OBJECT_SIZE ||
+            (r->plainSize != 0 && r->headLen >= r->dataLen)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool snapshot_load(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    if (!valid(base, size)) {
+        fprintf(stderr, "snapshot: %s is not a valid snapshot\n", path);
+        munmap(base, size);
+        return false;
+    }
+
+    const snap_header_t *header = base;
+    const snap_record_t *recs =
+        (const snap_record_t *)((const char *)base + sizeof(snap_header_t));
+    nbuckets = 1;
+    while (nbuckets < header->count) {
+        nbuckets *= 2;
+    }
+    entries = calloc(header->count ? header->count : 1, sizeof(snap_entry_t));
+    buckets = calloc(nbuckets, sizeof(snap_entry_t *));
+    if (entries == NULL || buckets == NULL) {
+        free(entries);
+        free(buckets);
+        entries = NULL;
+        munmap(base, size);
+        return false;
+    }
+    // Only the record table is read here; bodies are paged in on demand
+    for (uint32_t i = 0; i < header->count; i++) {
+        snap_entry_t *e = &entries[i];
+        e->rec = &recs[i];
+        e->taken = 0;
+        size_t b = recs[i].hash & (nbuckets - 1);
+        e->next = buckets[b];
+        buckets[b] = e;
+    }
+    map = base;
+    loaded = header->count;
+    return true;
+}
+
+bool snapshot_take(const char *key, const char **data, size_t *size,
+                   block_meta_t *meta, bool *stale) {
+    if (entries == NULL) {
+        return false;
+    }
+    uint64_t hash = hash_key(key);
+    size_t keyLen = strlen(key);
+    snap_entry_t *e = buckets[hash & (nbuckets - 1)];
+    for (; e != NULL; e = e->next) {
+        const snap_record_t *r = e->rec;
+        if (r->hash == hash && r->keyLen == keyLen &&
+            memcmp(map + r->keyOff, key, keyLen) == 0) {
+            break;
+        }
+    }
+    if (e == NULL || __atomic_exchange_n(&e->taken, 1, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    const snap_record_t *r = e->rec;
+    time_t now = time(NULL);
+    *stale = r->expires != 0 && r->expires <= now;
+    if (*stale && keep_until(r) <= now) {
+        return false;
+    }
+    // the etag is stored with its NUL, so it can be used in place
+    const char *etag = map + r->keyOff + r->keyLen;
+    uint64_t sum = checksum(CHECKSUM_SEED, key, keyLen);
+    sum = checksum(sum, etag, r->etagLen + 1);
+    if (etag[r->etagLen] != '\0' ||
+        checksum(sum, map + r->dataOff, r->dataLen) != r->checksum) {
+        __atomic_add_fetch(&corrupt, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    *data = map + r->dataOff;
+    *size = r->dataLen;
+    meta->keepAlive = r->keepAlive;
+    meta->cost = r->cost;
+    meta->expires = r->expires;
+    meta->staleWindow = r->staleWindow;
+    meta->lastModified = r->lastModified;
+    meta->etag = etag;
+    meta->plainSize = r->plainSize;
+    meta->headLen = r->headLen;
+    __atomic_add_fetch(&taken, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* Where the strings of one record to be written come from: a live block, or
+   the mapping of the snapshot that was loaded */
+typedef struct snap_source {
+    const char *key;
+    const char *etag;
+    const char *data;
+} snap_source_t;
+
+/* block_record - describe a pinned block in r, offsets aside */
+static void block_record(const block_t *b, snap_record_t *r,
+                         snap_source_t *src) {
+    r->hash = b->hash;
+    r->keyLen = strlen(b->key);
+    r->etagLen = strlen(b->etag);
+    r->dataLen = b->blockSize;
+    uint64_t sum = checksum(CHECKSUM_SEED, b->key, r->keyLen);
+    sum = checksum(sum, b->etag, r->etagLen + 1);
+    r->checksum = checksum(sum, b->data, b->blockSize);
+    r->expires = b->expires;
+    r->lastModified = b->lastModified;
+    r->staleWindow = b->staleWindow;
+    r->cost = b->cost;
+    r->plainSize = b->plainSize;
+    r->headLen = b->headLen;
+    r->keepAlive = b->keepAlive;
+    *src = (snap_source_t){b->key, b->etag, b->data};
+}
+
+/* by_hash - order pinned blocks by key hash */
+static int by_hash(const void *a, const void *b) {
+    uint64_t x = (*(block_t *const *)a)->hash;
+    uint64_t y = (*(block_t *const *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* cached - true if one of the n pinned blocks, sorted by_hash, is r's key */
+static bool cached(block_t **blocks, size_t n, const snap_record_t *r) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (blocks[mid]->hash < r->hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < n && blocks[lo]->hash == r->hash; lo++) {
+        if (strlen(blocks[lo]->key) == r->keyLen &&
+            memcmp(blocks[lo]->key, map + r->keyOff, r->keyLen) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* write_snapshot - lay the n described records out in f */
+static bool write_snapshot(FILE *f, snap_record_t *recs,
+                           const snap_source_t *srcs, size_t n,
+                           size_t *written) {
+    uint64_t off = sizeof(snap_header_t) + n * sizeof(snap_record_t);
+    for (size_t i = 0; i < n; i++) {
+        recs[i].keyOff = off;
+        off += recs[i].keyLen + recs[i].etagLen + 1;
+        recs[i].dataOff = off;
+        off += recs[i].dataLen;
+    }
+
+    snap_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.count = n;
+    header.size = off;
+    header.indexChecksum =
+        checksum(CHECKSUM_SEED, recs, n * sizeof(snap_record_t));
+    header.headerChecksum = header_checksum(&header);
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(recs, sizeof(snap_record_t), n, f) == n;
+    for (size_t i = 0; ok && i < n; i++) {
+        size_t etagLen = recs[i].etagLen + 1;
+        ok = fwrite(srcs[i].key, 1, recs[i].keyLen, f) == recs[i].keyLen &&
+             fwrite(srcs[i].etag, 1, etagLen, f) == etagLen &&
+             fwrite(srcs[i].data, 1, recs[i].dataLen, f) == recs[i].dataLen;
+    }
+    *written = off;
+    return ok;
+}
+
+bool snapshot_save(cache_t *cache, const char *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&saveLock);
+    size_t n;
+    block_t **blocks = cache_pin_all(cache, &n);
+    if (blocks == NULL) {
+        pthread_mutex_unlock(&saveLock);
+        return false;
+    }
+
+    // The cache's blocks, then the loaded records nobody has asked for yet:
+    // they were never moved into the cache, and would be lost otherwise.
+    // Those are copied as they are, checksum included, so one that went bad
+    // on disk is still caught when it is taken
+    size_t max = n + loaded;
+    snap_record_t *recs = calloc(max ? max : 1, sizeof(snap_record_t));
+    snap_source_t *srcs = calloc(max ? max : 1, sizeof(snap_source_t));
+    bool ok = recs != NULL && srcs != NULL;
+    size_t count = 0;
+    if (ok) {
+        for (size_t i = 0; i < n; i++) {
+            block_record(blocks[i], &recs[count], &srcs[count]);
+            count++;
+        }
+        qsort(blocks, n, sizeof(block_t *), by_hash);
+        time_t now = time(NULL);
+        for (size_t i = 0; i < loaded; i++) {
+            const snap_record_t *r = entries[i].rec;
+            if (__atomic_load_n(&entries[i].taken, __ATOMIC_RELAXED) ||
+                (r->expires != 0 && keep_until(r) <= now) ||
+                cached(blocks, n, r)) {
+                continue;
+            }
+            recs[count] = *r;
+            srcs[count] = (snap_source_t){map + r->keyOff,
+                                          map + r->keyOff + r->keyLen,
+                                          map + r->dataOff};
+            count++;
+        }
+    }
+
+    size_t written = 0;
+    FILE *f = ok ? fopen(tmp, "w") : NULL;
+    ok = f != NULL && write_snapshot(f, recs, srcs, count, &written) &&
+         fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (f != NULL && fclose(f) != 0) {
+        ok = false;
+    }
+    // Renaming leaves any mapping of the previous snapshot intact
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        unlink(tmp);
+    } else {
+        saves++;
+        lastSize = written;
+    }
+
+    free(recs);
+    free(srcs);
+    for (size_t i = 0; i < n; i++) {
+        release_block(blocks[i]);
+    }
+    free(blocks);
+    pthread_mutex_unlock(&saveLock);
+    return ok;
+}
+
+void snapshot_stats(snapshot_stats_t *stats) {
+    stats->loaded = loaded;
+    stats->taken = __atomic_load_n(&taken, __ATOMIC_RELAXED);
+    stats->corrupt = __atomic_load_n(&corrupt, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&saveLock);
+    stats->saves = saves;
+    stats->lastSize = lastSize;
+    pthread_mutex_unlock(&saveLock);
+}
@@ -0,0 +1,89 @@
+/*
+ * snapshot.h - cache contents saved to a file and mapped back after restart
+ *
+ * snapshot_save() writes every cached block to a file, with the records of
+ * the loaded snapshot that have not been taken yet: a header, a table of
+ * fixed-size records, then each key, etag and response body. The header
+ * carries a magic, a format version and checksums of itself and of the record
+ * table; each record carries the checksum of its own key, etag and body. The
+ * file is written under a temporary name and renamed into place, so a crash
+ * never leaves a half-written snapshot behind.
+ *
+ * snapshot_load() maps the file and checks only the header and record table,
+ * so a restarted proxy can answer from it at once. Bodies are paged in and
+ * checked the first time they are asked for; a record that fails its checksum
+ * is treated as a miss. One that has gone stale since it was saved is handed
+ * out as stale while the cache would still keep it (CACHE_STALE_KEEP), so it
+ * can be revalidated. Each record is handed out once, by snapshot_take(),
+ * whose caller moves it into the live cache.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cache.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define SNAPSHOT_MAGIC "PXYSNAP\n"
+#define SNAPSHOT_VERSION 4
+/* Seconds between periodic snapshots */
+#define SNAPSHOT_INTERVAL 300
+
+/* On-disk layout; integers are in the host's byte order */
+typedef struct snap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;          // records
+    uint64_t size;           // whole file
+    uint64_t indexChecksum;  // of the record table
+    uint64_t headerChecksum; // of the fields above
+} snap_header_t;
+
+typedef struct snap_record {
+    uint64_t hash;     // hash_key of the key
+    uint64_t keyOff;   // from the start of the file; the etag follows the key
+    uint64_t dataOff;
+    uint64_t dataLen;
+    uint64_t checksum; // of the key, the etag and the body
+    int64_t expires;   // wall clock second it goes stale, 0 for never
+    int64_t lastModified; // validator, -1 if none
+    uint32_t keyLen;
+    uint32_t etagLen;
+    uint32_t cost;        // block_t cost
+    uint32_t staleWindow; // block_t staleWindow
+    uint32_t plainSize;   // block_t plainSize
+    uint32_t headLen;     // block_t headLen
+    uint8_t keepAlive;
+    uint8_t pad[7];
+} snap_record_t;
+
+/* Snapshot counters */
+typedef struct snapshot_stats {
+    size_t loaded;         // records mapped at startup
+    unsigned long taken;   // records moved into the cache
+    unsigned long corrupt; // records that failed their checksum
+    unsigned long saves;   // snapshots written
+    size_t lastSize;       // bytes in the last snapshot written
+} snapshot_stats_t;
+
+/*snapshot_load: map the snapshot at path; false if there is none or it is
+  not valid, in which case the proxy starts cold*/
+bool snapshot_load(const char *path);
+
+/*snapshot_take: claim key's record from the loaded snapshot, fresh or, with
+  *stale set, stale but still worth revalidating. On success data and
+  meta->etag point into the mapping, which stays valid for the life of the
+  process*/
+bool snapshot_take(const char *key, const char **data, size_t *size,
+                   block_meta_t *meta, bool *stale);
+
+/*snapshot_save: write the cache's current blocks and the loaded records not
+  yet taken to path; false on error*/
+bool snapshot_save(cache_t *cache, const char *path);
+
+/*snapshot_stats: copy the current counters out*/
+void snapshot_stats(snapshot_stats_t *stats);
+
+#endif /* SNAPSHOT_H */
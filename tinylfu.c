@@ -0,0 +1,136 @@
+/*
+ * tinylfu.c - count-min sketch with a doorkeeper and periodic aging
+ */
+#include "tinylfu.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Per-row seeds, so each row spreads the same hash differently */
+static const uint64_t seeds[TINYLFU_ROWS] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL,
+    0xcbf29ce484222325ULL};
+
+/* mix - spread a key hash with a seed (the splitmix64 finalizer) */
+static uint64_t mix(uint64_t hash, uint64_t seed) {
+    uint64_t h = hash + seed;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+tinylfu_t *tinylfu_init(size_t width) {
+    tinylfu_t *sketch = malloc(sizeof(tinylfu_t));
+    if (sketch == NULL) {
+        printf("Error init sketch");
+        exit(1);
+    }
+    sketch->width = 1;
+    while (sketch->width < width) {
+        sketch->width *= 2;
+    }
+    sketch->doorBits = sketch->width * 8;
+    sketch->counters = calloc(TINYLFU_ROWS * sketch->width, sizeof(uint8_t));
+    sketch->doorkeeper = calloc(sketch->doorBits / 64, sizeof(uint64_t));
+    if (sketch->counters == NULL || sketch->doorkeeper == NULL) {
+        printf("Error init sketch");
+        exit(1);
+    }
+    sketch->additions = 0;
+    sketch->sampleSize = TINYLFU_SAMPLE_FACTOR * sketch->width;
+    return sketch;
+}
+
+/* counter - the key's counter in row i */
+static uint8_t *counter(tinylfu_t *sketch, uint64_t hash, int i) {
+    size_t col = mix(hash, seeds[i]) & (sketch->width - 1);
+    return &sketch->counters[i * sketch->width + col];
+}
+
+/* door_bit - the key's doorkeeper bit for probe i (of two) */
+static void door_bit(tinylfu_t *sketch, uint64_t hash, int i, size_t *word,
+                     uint64_t *bit) {
+    uint64_t h = mix(hash, ~seeds[i]) & (sketch->doorBits - 1);
+    *word = h / 64;
+    *bit = 1ULL << (h % 64);
+}
+
+static bool door_contains(tinylfu_t *sketch, uint64_t hash) {
+    for (int i = 0; i < 2; i++) {
+        size_t word;
+        uint64_t bit;
+        door_bit(sketch, hash, i, &word, &bit);
+        if ((__atomic_load_n(&sketch->doorkeeper[word], __ATOMIC_RELAXED) &
+             bit) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* door_add - set the key's bits; true if they were all set already */
+static bool door_add(tinylfu_t *sketch, uint64_t hash) {
+    bool seen = true;
+    for (int i = 0; i < 2; i++) {
+        size_t word;
+        uint64_t bit;
+        door_bit(sketch, hash, i, &word, &bit);
+        uint64_t old = __atomic_fetch_or(&sketch->doorkeeper[word], bit,
+                                         __ATOMIC_RELAXED);
+        if ((old & bit) == 0) {
+            seen = false;
+        }
+    }
+    return seen;
+}
+
+/*
+ * age - halve every counter and clear the doorkeeper, so the sketch reflects
+ *     the recent past rather than all time
+ */
+static void age(tinylfu_t *sketch) {
+    for (size_t i = 0; i < TINYLFU_ROWS * sketch->width; i++) {
+        uint8_t c = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&sketch->counters[i], c / 2, __ATOMIC_RELAXED);
+    }
+    for (size_t i = 0; i < sketch->doorBits / 64; i++) {
+        __atomic_store_n(&sketch->doorkeeper[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&sketch->additions, sketch->sampleSize / 2,
+                     __ATOMIC_RELAXED);
+}
+
+void tinylfu_record(tinylfu_t *sketch, uint64_t hash) {
+    // A key's first access since the last aging only reaches the doorkeeper
+    if (!door_add(sketch, hash)) {
+        return;
+    }
+
+    for (int i = 0; i < TINYLFU_ROWS; i++) {
+        uint8_t *c = counter(sketch, hash, i);
+        uint8_t n = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (n < TINYLFU_MAX_COUNT) {
+            __atomic_store_n(c, n + 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Exactly one thread sees the count reach the sample size
+    if (__atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED) ==
+        sketch->sampleSize) {
+        age(sketch);
+    }
+}
+
+unsigned tinylfu_estimate(tinylfu_t *sketch, uint64_t hash) {
+    unsigned min = TINYLFU_MAX_COUNT;
+    for (int i = 0; i < TINYLFU_ROWS; i++) {
+        uint8_t *c = counter(sketch, hash, i);
+        unsigned n = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (n < min) {
+            min = n;
+        }
+    }
+    // The doorkeeper holds each key's first access
+    return min + (door_contains(sketch, hash) ? 1 : 0);
+}
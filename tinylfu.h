@@ -0,0 +1,48 @@
+/*
+ * tinylfu.h - approximate access frequencies for cache admission
+ *
+ * A count-min sketch of small saturating counters estimates how often each
+ * key hash was looked up recently. A doorkeeper Bloom filter sits in front of
+ * it: a key's first access only sets its doorkeeper bits, so keys seen once
+ * never take sketch counters from keys seen again. After every
+ * TINYLFU_SAMPLE_FACTOR * width counted accesses all counters are halved and
+ * the doorkeeper is cleared, so old popularity fades.
+ *
+ * Every operation is lock-free and may run on any thread. Updates racing with
+ * each other or with aging can be lost; the estimates only steer admission.
+ */
+#ifndef TINYLFU_H
+#define TINYLFU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Counters per sketch row, rounded up to a power of two */
+#define TINYLFU_WIDTH 4096
+/* Sketch rows; an estimate is the smallest of the key's counters */
+#define TINYLFU_ROWS 4
+/* Counters saturate here */
+#define TINYLFU_MAX_COUNT 15
+/* Counted accesses between agings, in multiples of the width */
+#define TINYLFU_SAMPLE_FACTOR 10
+
+typedef struct tinylfu {
+    uint8_t *counters;    // TINYLFU_ROWS rows of width counters
+    size_t width;         // power of two
+    uint64_t *doorkeeper; // Bloom filter of keys seen since the last aging
+    size_t doorBits;      // power of two
+    size_t additions;     // sketch increments since the last aging
+    size_t sampleSize;    // additions that trigger an aging
+} tinylfu_t;
+
+/*tinylfu_init: an empty sketch of about width counters per row*/
+tinylfu_t *tinylfu_init(size_t width);
+
+/*tinylfu_record: count one access to the key with this hash*/
+void tinylfu_record(tinylfu_t *sketch, uint64_t hash);
+
+/*tinylfu_estimate: recent accesses to the key with this hash; collisions can
+  only inflate it*/
+unsigned tinylfu_estimate(tinylfu_t *sketch, uint64_t hash);
+
+#endif /* TINYLFU_H */
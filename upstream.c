@@ -0,0 +1,601 @@
+/*
+ * upstream.c - origin connections, response framing and the keep-alive pool
+ *
+ * Idle sockets are kept per origin in a small array ordered oldest first, so
+ * expiring them only ever looks at the front and a borrow takes the newest,
+ * which is the one least likely to have been closed by the origin. The table
+ * of origins is shared by every worker behind one mutex; it is held only to
+ * push or pop a descriptor, never across a syscall on a socket.
+ */
+#define _GNU_SOURCE
+#include "upstream.h"
+#include "dns.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ORIGIN_BUCKETS 256
+#define SPLICE_CHUNK (64 * 1024)
+
+typedef struct idle_sock {
+    int fd;
+    time_t since; // When the socket was released
+} idle_sock_t;
+
+/* Idle sockets to one origin, oldest first. */
+typedef struct origin {
+    char key[UPSTREAM_KEYLEN];
+    idle_sock_t idle[UPSTREAM_MAX_IDLE];
+    size_t nidle;
+    struct origin *next;
+} origin_t;
+
+static bool enabled = false;
+static origin_t *origins[ORIGIN_BUCKETS];
+static pthread_mutex_t originLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each worker keeps one pipe for splicing between its two sockets
+static __thread int relayPipe[2] = {-1, -1};
+
+void upstream_init(bool keepalive) {
+    enabled = keepalive;
+}
+
+bool upstream_keepalive(void) {
+    return enabled;
+}
+
+/* find_origin - look up an origin's entry, creating it if asked to */
+static origin_t *find_origin(const char *key, bool create) {
+    uint32_t h = 2166136261u;
+    for (const char *p = key; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    origin_t **slot = &origins[h % ORIGIN_BUCKETS];
+    for (origin_t *o = *slot; o != NULL; o = o->next) {
+        if (strcmp(o->key, key) == 0) {
+            return o;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    origin_t *o = Calloc(1, sizeof(origin_t));
+    strcpy(o->key, key);
+    o->next = *slot;
+    *slot = o;
+    return o;
+}
+
+/*
+ * expire_idle - drop sockets idle past UPSTREAM_IDLE_TIMEOUT from the front
+ *     of an origin's list, storing them in dead for the caller to close once
+ *     the lock is released. Returns the number dropped.
+ */
+static size_t expire_idle(origin_t *o, time_t now, int *dead) {
+    size_t n = 0;
+    while (n < o->nidle && o->idle[n].since + UPSTREAM_IDLE_TIMEOUT <= now) {
+        dead[n] = o->idle[n].fd;
+        n++;
+    }
+    memmove(o->idle, o->idle + n, (o->nidle - n) * sizeof(idle_sock_t));
+    o->nidle -= n;
+    return n;
+}
+
+static void close_all(int *fds, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+}
+
+/* head_reset - forget what an earlier head said about the body and caching */
+static void head_reset(upstream_t *up) {
+    up->length = -1;
+    up->rangeStart = -1;
+    up->rangeTotal = -1;
+    up->chunked = false;
+    up->noStore = false;
+    up->noCache = false;
+    up->mustRevalidate = false;
+    up->maxAge = -1;
+    up->sMaxAge = -1;
+    up->staleRevalidate = -1;
+    up->age = 0;
+    up->date = -1;
+    up->expiresAt = -1;
+    up->lastModified = -1;
+    up->expires = 0;
+    up->etag[0] = '\0';
+}
+
+/* take_idle - pop the newest idle socket to an origin, or -1 if none */
+static int take_idle(const char *key) {
+    int dead[UPSTREAM_MAX_IDLE];
+    size_t ndead = 0;
+    int fd = -1;
+
+    pthread_mutex_lock(&originLock);
+    origin_t *o = find_origin(key, false);
+    if (o != NULL) {
+        ndead = expire_idle(o, time(NULL), dead);
+        if (o->nidle > 0) {
+            fd = o->idle[--o->nidle].fd;
+        }
+    }
+    pthread_mutex_unlock(&originLock);
+
+    close_all(dead, ndead);
+    return fd;
+}
+
+/*
+ * still_open - returns true if an idle socket has neither been closed by the
+ *     origin nor received stray bytes while it sat in the pool
+ */
+static bool still_open(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_open(upstream_t *up, const char *host, const char *port,
+                  bool fresh) {
+    up->reused = false;
+    up->state = UP_HEAD;
+    up->remaining = 0;
+    up->status = 0;
+    up->keepAlive = false;
+    head_reset(up);
+    up->lineLen = 0;
+    up->relayed = 0;
+    if (snprintf(up->key, UPSTREAM_KEYLEN, "%s:%s", host, port) >=
+        UPSTREAM_KEYLEN) {
+        up->key[0] = '\0';
+    }
+
+    int fd = -1;
+    if (enabled && !fresh && up->key[0] != '\0') {
+        while ((fd = take_idle(up->key)) >= 0 && !still_open(fd)) {
+            close(fd);
+        }
+    }
+    if (fd >= 0) {
+        up->reused = true;
+    } else if ((fd = dns_connect(host, port)) < 0) {
+        return fd;
+    } else {
+        // Requests go out in one writev, so Nagle never has anything to
+        // coalesce; it would only hold a request on a reused connection
+        // behind the delayed ACK for the previous response
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    up->fd = fd;
+    rio_readinitb(&up->rio, fd);
+    return 0;
+}
+
+bool upstream_responding(upstream_t *up) {
+    if (!up->reused) {
+        return true;
+    }
+    char c;
+    ssize_t n;
+    while ((n = recv(up->fd, &c, 1, MSG_PEEK)) < 0 && errno == EINTR) {
+    }
+    return n > 0;
+}
+
+/*
+ * http_date - parse an HTTP date in the preferred format or either of the
+ *     two obsolete ones; -1 if it is none of them
+ */
+static time_t http_date(const char *value) {
+    static const char *const formats[] = {"%a, %d %b %Y %H:%M:%S GMT",
+                                          "%A, %d-%b-%y %H:%M:%S GMT",
+                                          "%a %b %e %H:%M:%S %Y"};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, formats[i], &tm) != NULL) {
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+/* delta_seconds - a directive or header's seconds, -1 if not a number */
+static long long delta_seconds(const char *value) {
+    char *end;
+    long long secs = strtoll(value, &end, 10);
+    if (end == value || secs < 0) {
+        return -1;
+    }
+    return secs < UPSTREAM_MAX_LIFETIME ? secs : UPSTREAM_MAX_LIFETIME;
+}
+
+/* directive_is - true if the n bytes at p are the directive name */
+static bool directive_is(const char *p, size_t n, const char *name) {
+    return strlen(name) == n && strncasecmp(p, name, n) == 0;
+}
+
+/* cache_control - apply the directives of one Cache-Control header */
+static void cache_control(upstream_t *up, const char *value) {
+    const char *p = value;
+    while (*(p += strspn(p, " \t,")) != '\0') {
+        size_t n = strcspn(p, "=, \t");
+        const char *arg = p + n + strspn(p + n, " \t");
+        long long secs = -1;
+        if (*arg == '=') {
+            arg += 1 + strspn(arg + 1, " \t\"");
+            secs = delta_seconds(arg);
+        }
+
+        if (directive_is(p, n, "no-store") || directive_is(p, n, "private")) {
+            up->noStore = true;
+        } else if (directive_is(p, n, "no-cache")) {
+            up->noCache = true;
+            up->mustRevalidate = true;
+        } else if (directive_is(p, n, "must-revalidate") ||
+                   directive_is(p, n, "proxy-revalidate")) {
+            up->mustRevalidate = true;
+        } else if (directive_is(p, n, "stale-while-revalidate")) {
+            up->staleRevalidate = secs;
+        } else if (directive_is(p, n, "max-age")) {
+            up->maxAge = secs;
+        } else if (directive_is(p, n, "s-maxage")) {
+            up->sMaxAge = secs;
+        }
+        p += strcspn(p, ",");
+    }
+}
+
+/*
+ * freshness - when a response received at now goes stale, 0 if its head
+ *     gives no lifetime. Ages are measured from the origin's Date where it
+ *     has one, as long as that is not in the future.
+ */
+static time_t freshness(const upstream_t *up, time_t now) {
+    time_t date = up->date >= 0 && up->date <= now ? up->date : now;
+    long long lifetime;
+    if (up->noCache) {
+        return now; // stale on arrival: it may not be reused unchecked
+    } else if (up->sMaxAge >= 0) {
+        lifetime = up->sMaxAge; // meant for shared caches like this one
+    } else if (up->maxAge >= 0) {
+        lifetime = up->maxAge;
+    } else if (up->expiresAt >= 0) {
+        lifetime = up->expiresAt - date;
+    } else if (up->lastModified >= 0 && up->lastModified <= date) {
+        lifetime = (date - up->lastModified) / 10;
+        if (lifetime > UPSTREAM_HEURISTIC_MAX) {
+            lifetime = UPSTREAM_HEURISTIC_MAX;
+        }
+    } else {
+        return 0;
+    }
+
+    long long age = now - date > up->age ? now - date : up->age;
+    return lifetime > age ? now + (lifetime - age) : now;
+}
+
+/* head_done - pick the body framing once the blank line ends the head */
+static void head_done(upstream_t *up) {
+    if (up->status / 100 == 1) {
+        up->status = 0; // Interim response: the real head follows
+        return;
+    }
+
+    // A response that is already stale is only worth keeping if it can be
+    // revalidated
+    time_t now = time(NULL);
+    up->expires = freshness(up, now);
+    if (up->expires != 0 && up->expires <= now && up->etag[0] == '\0' &&
+        up->lastModified < 0) {
+        up->noStore = true;
+    }
+
+    if (up->status == 204 || up->status == 304) {
+        up->state = UP_DONE;
+    } else if (up->chunked) {
+        up->state = UP_CHUNK_SIZE;
+    } else if (up->length >= 0) {
+        up->remaining = up->length;
+        up->state = up->length > 0 ? UP_LENGTH : UP_DONE;
+    } else {
+        up->state = UP_EOF;
+        up->keepAlive = false;
+    }
+}
+
+/* head_line - parse one status or header line of the response head */
+static void head_line(upstream_t *up, char *line) {
+    if (up->status == 0) {
+        int major, minor, status;
+        if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3 ||
+            status <= 0) {
+            up->state = UP_EOF; // Not HTTP we understand: relay until close
+            up->keepAlive = false;
+            return;
+        }
+        up->status = status;
+        up->keepAlive = major > 1 || (major == 1 && minor >= 1);
+        head_reset(up);
+        return;
+    }
+    if (*line == '\0') {
+        head_done(up);
+        return;
+    }
+
+    char *value = strchr(line, ':');
+    if (value == NULL) {
+        return;
+    }
+    *value++ = '\0';
+    value += strspn(value, " \t");
+
+    if (strcasecmp(line, "Content-Length") == 0) {
+        char *end;
+        long long length = strtoll(value, &end, 10);
+        up->length = (end != value && length >= 0) ? length : -1;
+    } else if (strcasecmp(line, "Content-Range") == 0) {
+        long long first, last, total;
+        if (sscanf(value, "bytes %lld-%lld/%lld", &first, &last, &total) ==
+                3 &&
+            first >= 0 && first <= last && last < total) {
+            up->rangeStart = first;
+            up->rangeTotal = total;
+        }
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+        up->chunked = strcasestr(value, "chunked") != NULL;
+    } else if (strcasecmp(line, "Cache-Control") == 0) {
+        cache_control(up, value);
+    } else if (strcasecmp(line, "Expires") == 0) {
+        time_t at = http_date(value);
+        up->expiresAt = at >= 0 ? at : 0; // unreadable means already stale
+    } else if (strcasecmp(line, "Date") == 0) {
+        up->date = http_date(value);
+    } else if (strcasecmp(line, "Last-Modified") == 0) {
+        up->lastModified = http_date(value);
+    } else if (strcasecmp(line, "ETag") == 0) {
+        size_t n = strlen(value);
+        while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t')) {
+            n--;
+        }
+        if (n < sizeof(up->etag)) {
+            memcpy(up->etag, value, n);
+            up->etag[n] = '\0';
+        }
+    } else if (strcasecmp(line, "Age") == 0) {
+        long long age = delta_seconds(value);
+        up->age = age >= 0 ? age : 0;
+    } else if (strcasecmp(line, "Connection") == 0) {
+        if (strcasestr(value, "close") != NULL) {
+            up->keepAlive = false;
+        } else if (strcasestr(value, "keep-alive") != NULL) {
+            up->keepAlive = true;
+        }
+    }
+}
+
+/* line_done - act on a complete line in a line-oriented state */
+static void line_done(upstream_t *up) {
+    char *line = up->line;
+    size_t len = up->lineLen;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        len--;
+    }
+    line[len] = '\0';
+    up->lineLen = 0;
+
+    if (up->state == UP_HEAD) {
+        head_line(up, line);
+    } else if (up->state == UP_CHUNK_SIZE) {
+        char *end;
+        long long size = strtoll(line, &end, 16);
+        if (end == line || size < 0) {
+            up->state = UP_EOF; // Garbled chunking: relay until close
+            up->keepAlive = false;
+        } else if (size == 0) {
+            up->state = UP_TRAILER;
+        } else {
+            up->remaining = size + 2; // Chunk data and its CRLF
+            up->state = UP_CHUNK_DATA;
+        }
+    } else if (up->state == UP_TRAILER && len == 0) {
+        up->state = UP_DONE;
+    }
+}
+
+/* read_line - relay bytes of a head, chunk size or trailer line */
+static ssize_t read_line(upstream_t *up, char *buf, size_t n) {
+    ssize_t got = n < 2 ? rio_readnb(&up->rio, buf, 1)
+                        : rio_readlineb(&up->rio, buf, n);
+    if (got <= 0) {
+        // A close before any response byte is an empty response
+        bool empty = up->state == UP_HEAD && up->status == 0 &&
+                     up->lineLen == 0;
+        return got == 0 && empty ? 0 : -1;
+    }
+
+    // Lines longer than the parse buffer are only parsed up to its size
+    size_t keep = MAXLINE - 1 - up->lineLen;
+    keep = (size_t)got < keep ? (size_t)got : keep;
+    memcpy(up->line + up->lineLen, buf, keep);
+    up->lineLen += keep;
+    if (buf[got - 1] == '\n') {
+        line_done(up);
+    }
+    return got;
+}
+
+/* body_room - bytes that may be read next in a body state */
+static size_t body_room(upstream_t *up, size_t n) {
+    if (up->state != UP_EOF && (long long)n > up->remaining) {
+        return up->remaining;
+    }
+    return n;
+}
+
+/* body_consumed - account for got body bytes, moving on at the end */
+static void body_consumed(upstream_t *up, ssize_t got) {
+    if (up->state == UP_EOF) {
+        return;
+    }
+    up->remaining -= got;
+    if (up->remaining == 0) {
+        up->state = up->state == UP_LENGTH ? UP_DONE : UP_CHUNK_SIZE;
+    }
+}
+
+ssize_t upstream_read(upstream_t *up, char *buf, size_t n) {
+    ssize_t got;
+    switch (up->state) {
+    case UP_DONE:
+        return 0;
+    case UP_EOF:
+        if ((got = rio_readnb(&up->rio, buf, n)) == 0) {
+            up->state = UP_DONE;
+        }
+        return got;
+    case UP_LENGTH:
+    case UP_CHUNK_DATA:
+        if ((got = rio_readnb(&up->rio, buf, body_room(up, n))) <= 0) {
+            return -1; // Origin closed inside a framed body
+        }
+        body_consumed(up, got);
+        return got;
+    default:
+        return read_line(up, buf, n);
+    }
+}
+
+/* relay_pipe - the calling thread's splice pipe, created on first use */
+static int *relay_pipe(void) {
+    if (relayPipe[0] < 0 && pipe2(relayPipe, O_CLOEXEC) < 0) {
+        return NULL;
+    }
+    return relayPipe;
+}
+
+/* drop_pipe - close a pipe left holding bytes that will never be sent */
+static void drop_pipe(void) {
+    close(relayPipe[0]);
+    close(relayPipe[1]);
+    relayPipe[0] = relayPipe[1] = -1;
+}
+
+/*
+ * splice_body - move up to n body bytes from the origin socket to outfd
+ *     through the thread's pipe without copying them into user space.
+ *     Returns the bytes moved, 0 at end of file, -1 if splice cannot be
+ *     used here and -2 if outfd failed.
+ */
+static ssize_t splice_body(upstream_t *up, int outfd, size_t n) {
+    int *p = relay_pipe();
+    if (p == NULL) {
+        return -1;
+    }
+    ssize_t got;
+    while ((got = splice(up->fd, NULL, p[1], NULL, n,
+                         SPLICE_F_MOVE | SPLICE_F_MORE)) < 0 &&
+           errno == EINTR) {
+    }
+    if (got <= 0) {
+        return got;
+    }
+
+    for (ssize_t left = got; left > 0;) {
+        ssize_t put = splice(p[0], NULL, outfd, NULL, left,
+                             SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            drop_pipe();
+            return -2;
+        }
+        left -= put;
+    }
+    return got;
+}
+
+int upstream_relay(upstream_t *up, int outfd) {
+    char buf[MAXLINE];
+    bool spliceOk = true;
+
+    while (up->state != UP_DONE) {
+        bool body = up->state == UP_LENGTH || up->state == UP_CHUNK_DATA ||
+                    up->state == UP_EOF;
+
+        // Bytes rio already buffered, and line framing, take the copy path
+        if (body && spliceOk && up->rio.rio_cnt == 0) {
+            ssize_t got = splice_body(up, outfd, body_room(up, SPLICE_CHUNK));
+            if (got > 0) {
+                body_consumed(up, got);
+                up->relayed += got;
+                continue;
+            }
+            if (got == 0) {
+                if (up->state != UP_EOF) {
+                    return -1; // Origin closed inside a framed body
+                }
+                up->state = UP_DONE;
+                break;
+            }
+            if (got == -2) {
+                return -2;
+            }
+            spliceOk = false; // Not spliceable: copy from here on
+        }
+
+        ssize_t got = upstream_read(up, buf, sizeof(buf));
+        if (got < 0) {
+            return -1;
+        }
+        if (got > 0 && rio_writen(outfd, buf, got) < 0) {
+            return -2;
+        }
+        up->relayed += got;
+    }
+    return 0;
+}
+
+void upstream_release(upstream_t *up) {
+    int dead[UPSTREAM_MAX_IDLE];
+    size_t ndead = 0;
+    bool pooled = false;
+
+    if (enabled && up->key[0] != '\0' && up->state == UP_DONE &&
+        up->keepAlive && up->rio.rio_cnt == 0) {
+        time_t now = time(NULL);
+        pthread_mutex_lock(&originLock);
+        origin_t *o = find_origin(up->key, true);
+        ndead = expire_idle(o, now, dead);
+        if (o->nidle < UPSTREAM_MAX_IDLE) {
+            o->idle[o->nidle].fd = up->fd;
+            o->idle[o->nidle].since = now;
+            o->nidle++;
+            pooled = true;
+        }
+        pthread_mutex_unlock(&originLock);
+    }
+
+    close_all(dead, ndead);
+    if (!pooled) {
+        close(up->fd);
+    }
+}
@@ -0,0 +1,115 @@
+/*
+ * upstream.h - origin connections, with an optional keep-alive pool
+ *
+ * A miss borrows an upstream_t, writes its request to up->fd and reads the
+ * response back through upstream_read(), which hands out the raw response
+ * bytes but stops exactly where the message ends. Framing comes from the
+ * response head: Content-Length, chunked transfer coding, or the origin
+ * closing the connection. A socket whose response ended cleanly and whose
+ * origin agreed to keep it open goes back to a per-(host, port) idle list
+ * when the connection is released, so the next miss on that origin skips the
+ * DNS lookup and TCP handshake.
+ *
+ * The response head also says how long a copy stays fresh. Once the head is
+ * read, up->expires holds the time it goes stale: the lifetime comes from
+ * Cache-Control's s-maxage or max-age, else Expires less Date, else a tenth
+ * of the time since Last-Modified, and the Age it arrived with is taken off.
+ * The head's validators, ETag and Last-Modified, let a stale copy be checked
+ * with a conditional request later, and stale-while-revalidate says how long
+ * it may still be served while that happens.
+ *
+ * The pool is off unless upstream_init() is told otherwise; every request is
+ * then sent as HTTP/1.0 with Connection: close, and each release closes the
+ * socket.
+ */
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include "csapp.h"
+#include <stdbool.h>
+#include <time.h>
+
+/* Seconds an idle origin socket is kept before it is closed */
+#define UPSTREAM_IDLE_TIMEOUT 30
+/* Idle sockets kept per origin; extra released sockets are closed */
+#define UPSTREAM_MAX_IDLE 8
+/* Longest host:port key the pool tracks; longer origins are not pooled */
+#define UPSTREAM_KEYLEN 272
+/* Longest lifetime guessed from Last-Modified, in seconds */
+#define UPSTREAM_HEURISTIC_MAX (24 * 60 * 60)
+/* Longer lifetimes are cut to this, as RFC 9111 suggests */
+#define UPSTREAM_MAX_LIFETIME 2147483648LL
+/* Longest ETag kept as a validator, including its NUL */
+#define UPSTREAM_ETAG_LEN 128
+
+/* Where upstream_read() is in the response */
+typedef enum {
+    UP_HEAD,       // Status line and headers
+    UP_LENGTH,     // Body of known length: remaining bytes left
+    UP_CHUNK_SIZE, // Chunk size line
+    UP_CHUNK_DATA, // Chunk data plus its CRLF: remaining bytes left
+    UP_TRAILER,    // Trailer lines after the last chunk
+    UP_EOF,        // Body runs until the origin closes the connection
+    UP_DONE        // Message complete
+} upstream_state;
+
+/* One borrowed origin connection and its response framing state. */
+typedef struct upstream {
+    int fd;                     // Origin socket
+    rio_t rio;                  // Buffered response bytes
+    bool reused;                // Came from the idle pool
+    char key[UPSTREAM_KEYLEN];  // host:port, empty if not poolable
+    upstream_state state;       // Framing state
+    long long remaining;        // Bytes left in the body or current chunk
+    int status;                 // Response status code, 0 until parsed
+    long long length;           // Content-Length, -1 if absent
+    long long rangeStart;       // Content-Range first byte, -1 if absent
+    long long rangeTotal;       // Content-Range object length, -1 if absent
+    bool chunked;               // Transfer-Encoding: chunked
+    bool keepAlive;             // Origin will keep the connection open
+    bool noStore;               // Cache-Control forbids keeping a copy
+    bool noCache;               // Cache-Control wants every use revalidated
+    bool mustRevalidate;        // never serve it stale without checking
+    long long maxAge;           // Cache-Control max-age, -1 if absent
+    long long sMaxAge;          // Cache-Control s-maxage, -1 if absent
+    long long staleRevalidate;  // stale-while-revalidate, -1 if absent
+    long long age;              // Age, 0 if absent
+    time_t date;                // Date, -1 if absent or unreadable
+    time_t expiresAt;           // Expires, -1 if absent, 0 if unreadable
+    time_t lastModified;        // Last-Modified, -1 if absent or unreadable
+    time_t expires;             // When the response goes stale, 0 for never
+    char etag[UPSTREAM_ETAG_LEN]; // ETag, empty if absent or too long
+    char line[MAXLINE];         // Current head/chunk line, for parsing
+    size_t lineLen;
+    size_t relayed;             // Bytes upstream_relay sent on
+} upstream_t;
+
+/*upstream_init: enable or disable the keep-alive pool*/
+void upstream_init(bool keepalive);
+
+/*upstream_keepalive: true if requests should ask the origin to keep alive*/
+bool upstream_keepalive(void);
+
+/*upstream_open: borrow a pooled socket, or connect if fresh or none idle;
+  returns dns_connect's negative error if there is no socket to be had*/
+int upstream_open(upstream_t *up, const char *host, const char *port,
+                  bool fresh);
+
+/*upstream_responding: block until a reused socket shows a response byte;
+  false if the origin closed it while it sat idle*/
+bool upstream_responding(upstream_t *up);
+
+/*upstream_read: read up to n raw response bytes, stopping at the end of the
+  message; returns 0 there, -1 on error or a truncated framed body*/
+ssize_t upstream_read(upstream_t *up, char *buf, size_t n);
+
+/*upstream_relay: send the rest of the response to outfd, splicing body bytes
+  socket to socket; returns 0 at the end of the message, -1 if the origin
+  failed and -2 if outfd did*/
+int upstream_relay(upstream_t *up, int outfd);
+
+/*upstream_release: pool the socket if its response ended cleanly and the
+  origin allows it, otherwise close it*/
+void upstream_release(upstream_t *up);
+
+#endif /* UPSTREAM_H */
@@ -0,0 +1,126 @@
+/*
+ * wheel.c - hierarchical timing wheel
+ *
+ * A timer is placed by how far off it is from the next second to run: on
+ * level 0 by its own second, on level L by its second shifted right by
+ * L * WHEEL_BITS. The wheel runs one second at a time; when the low bits of
+ * that second reach zero, the matching slot of each level above is emptied
+ * and its timers placed again, now closer, before the level 0 slot fires.
+ */
+#include "wheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+/* span - seconds covered by the levels below level */
+static uint64_t span(int level) {
+    return (uint64_t)1 << (WHEEL_BITS * level);
+}
+
+/* place - link a timer into the slot its expiry falls in */
+static void place(wheel_t *wheel, wheel_timer_t *timer) {
+    uint64_t at = timer->expires;
+    if (at < wheel->next) {
+        at = wheel->next; // already due
+    }
+    uint64_t delta = at - wheel->next;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= span(level + 1)) {
+        level++;
+    }
+    if (delta >= span(WHEEL_LEVELS)) {
+        at = wheel->next + span(WHEEL_LEVELS) - 1; // beyond the top level
+    }
+
+    wheel_timer_t **slot =
+        &wheel->slots[level][(at >> (WHEEL_BITS * level)) & SLOT_MASK];
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    wheel->count++;
+}
+
+/* take_slot - empty a slot, returning its timers still chained */
+static wheel_timer_t *take_slot(wheel_t *wheel, wheel_timer_t **slot) {
+    wheel_timer_t *timers = *slot;
+    *slot = NULL;
+    for (wheel_timer_t *t = timers; t != NULL; t = t->next) {
+        t->slot = NULL;
+        wheel->count--;
+    }
+    return timers;
+}
+
+void wheel_init(wheel_t *wheel, uint64_t now) {
+    wheel->next = now;
+    wheel->count = 0;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            wheel->slots[l][i] = NULL;
+        }
+    }
+}
+
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer) {
+    place(wheel, timer);
+}
+
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->slot == NULL) {
+        return;
+    }
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->slot = NULL;
+    timer->next = NULL;
+    timer->prev = NULL;
+    wheel->count--;
+}
+
+wheel_timer_t *wheel_advance(wheel_t *wheel, uint64_t now) {
+    wheel_timer_t *fired = NULL;
+    while (wheel->next <= now) {
+        if (wheel->count == 0) {
+            wheel->next = now + 1; // nothing to run through
+            break;
+        }
+        uint64_t second = wheel->next;
+
+        // Bring down the slots whose span starts at this second
+        for (int l = 1; l < WHEEL_LEVELS && (second & (span(l) - 1)) == 0;
+             l++) {
+            size_t i = (second >> (WHEEL_BITS * l)) & SLOT_MASK;
+            wheel_timer_t *t = take_slot(wheel, &wheel->slots[l][i]);
+            while (t != NULL) {
+                wheel_timer_t *next = t->next;
+                place(wheel, t);
+                t = next;
+            }
+        }
+
+        wheel_timer_t *t =
+            take_slot(wheel, &wheel->slots[0][second & SLOT_MASK]);
+        wheel->next = second + 1;
+        while (t != NULL) {
+            wheel_timer_t *next = t->next;
+            if (t->expires <= second) {
+                t->prev = NULL;
+                t->next = fired;
+                fired = t;
+            } else {
+                place(wheel, t); // held back from beyond the top level
+            }
+            t = next;
+        }
+    }
+    return fired;
+}
@@ -0,0 +1,55 @@
+/*
+ * wheel.h - hierarchical timing wheel for cache expiry
+ *
+ * Timers are intrusive: the owner embeds a wheel_timer_t and gets it back
+ * when it fires. Times are whole seconds on the wall clock. Level 0 has one
+ * slot per second for the next WHEEL_SLOTS seconds; each level above covers
+ * WHEEL_SLOTS times the span of the one below, and its slots are emptied
+ * into the lower levels as the wheel reaches them. Adding and removing a
+ * timer is O(1), and each timer is moved at most once per level before it
+ * fires, so expiring never scans timers that are not due.
+ *
+ * A wheel does no locking of its own; each cache shard guards its wheel with
+ * the shard lock.
+ */
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Slots per level, a power of two */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+/* Levels; timers further out than the top level reaches wait in its last
+   slot and are placed again when they come down */
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer {
+    uint64_t expires; // wall clock second it fires at
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    struct wheel_timer **slot; // list head it is on, NULL when not queued
+} wheel_timer_t;
+
+typedef struct wheel {
+    uint64_t next; // the next second to run
+    size_t count;  // timers queued
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+/*wheel_init: an empty wheel whose next second to run is now*/
+void wheel_init(wheel_t *wheel, uint64_t now);
+
+/*wheel_add: queue a timer to fire at timer->expires; one already due fires
+  at the next wheel_advance*/
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer);
+
+/*wheel_del: take a timer off the wheel; a timer not queued is left alone*/
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer);
+
+/*wheel_advance: run the wheel through second now and return the timers that
+  fired, off the wheel and chained through their next pointers*/
+wheel_timer_t *wheel_advance(wheel_t *wheel, uint64_t now);
+
+#endif /* WHEEL_H */